@@ -3,73 +3,3324 @@
  *
  * Streaming PNG decoder: parses chunks, inflates IDAT data via tinfl,
  * reconstructs scanline filters, converts to RGB565 row-by-row.
- * Supports 1/2 and 1/4 downscaling via pixel averaging.
+ * Downscales in the same pass: 1/2 and 1/4 by averaging pixel boxes,
+ * any other factor or size (sped_decode_size) through an area filter.
  *
  * Requires: miniz.h (tinfl) — available in ESP-IDF via esp_rom,
- * or from https://github.com/richgel999/miniz
+ * or from https://github.com/richgel999/miniz — unless built with
+ * another DEFLATE backend (in-tree, zlib, zlib-ng; see below).
  */
 
 #include "sped.h"
 #include <string.h>
 #include <stdlib.h>
 
+/* DEFLATE backend, chosen at compile time (see "DEFLATE backends" below):
+ *   default                 tinfl from miniz, via SPED_INFLATE_INCLUDE
+ *   SPED_INFLATE_BUILTIN    the in-tree inflater, no dependency
+ *   SPED_INFLATE_ZLIB       system zlib
+ *   SPED_INFLATE_ZLIBNG     zlib-ng, native zng_ API
+ * SPED_INFLATE_LIBDEFLATE adds a whole-image path through libdeflate,
+ * used when the raw image fits in SPED_WHOLE_MAX bytes; larger images
+ * and failed allocations fall back to the streaming backend. */
+#if defined(SPED_INFLATE_ZLIBNG)
+#include <zlib-ng.h>
+#define SPED_WINDOW 32768
+#elif defined(SPED_INFLATE_ZLIB)
+#include <zlib.h>
+#define SPED_WINDOW 32768
+#elif defined(SPED_INFLATE_BUILTIN)
+#define SPED_WINDOW 32768
+#else
+#define SPED_INFLATE_TINFL 1
 #ifndef SPED_INFLATE_INCLUDE
 #define SPED_INFLATE_INCLUDE "miniz.h"
 #endif
 #include SPED_INFLATE_INCLUDE
+#define SPED_WINDOW TINFL_LZ_DICT_SIZE
+#endif
+
+#ifdef SPED_INFLATE_LIBDEFLATE
+#include <libdeflate.h>
+#ifndef SPED_WHOLE_MAX
+#define SPED_WHOLE_MAX (64u << 20)
+#endif
+#endif
+
+/* Backend status, numbered as tinfl's */
+enum { SPED_INF_DONE = 0, SPED_INF_NEEDS_INPUT = 1, SPED_INF_HAS_OUTPUT = 2,
+       SPED_INF_FAILED = -1 };
+
+/* Kernel templates must be inlined to specialise on their constants */
+#if defined(__GNUC__)
+#define SPED_TEMPLATE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define SPED_TEMPLATE static __forceinline
+#else
+#define SPED_TEMPLATE static inline
+#endif
+
+/* SIMD kernels are used on x86 unless SPED_NO_SIMD is defined. SSE2 is
+ * assumed when the compiler targets it; AVX2/SSSE3 paths are compiled
+ * with per-function target attributes and chosen at runtime. */
+#if !defined(SPED_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define SPED_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPED_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef SPED_X86_DISPATCH
+enum { SPED_CPU_SSSE3 = 1, SPED_CPU_AVX2 = 2 };
+
+/* Runtime CPU features, probed once. Threads decoding stripes may get
+ * here together: each probes the same answer, and the relaxed atomics
+ * keep that from being a data race. */
+static int sped_cpu(void)
+{
+    static int feat = -1;
+    int f = __atomic_load_n(&feat, __ATOMIC_RELAXED);
+    if (f < 0) {
+        f = 0;
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3")) f |= SPED_CPU_SSSE3;
+        if (__builtin_cpu_supports("avx2"))  f |= SPED_CPU_AVX2;
+        __atomic_store_n(&feat, f, __ATOMIC_RELAXED);
+    }
+    return f;
+}
+#endif
+
+/* PNG file signature */
+static const uint8_t png_sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+/* Read 4-byte big-endian integer */
+static uint32_t r32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Paeth predictor (PNG filter type 4).
+ * Branch-free form: equivalent to the spec's pa/pb/pc comparison, but
+ * compiles to conditional moves instead of unpredictable branches. */
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int thresh = (int)c * 3 - ((int)a + (int)b);
+    int lo = a < b ? a : b;
+    int hi = a < b ? b : a;
+    int t0 = (hi <= thresh) ? lo : c;
+    return (uint8_t)((thresh <= lo) ? hi : t0);
+}
+
+/* ---- Inverse scanline filters ----
+ *
+ * One kernel per (filter, bpp) pair, picked once per image by
+ * unfilter_select(). Each reconstructs bytes [i, n) of a scanline from
+ * the filtered bytes in src into dst. src may equal dst (in place) or
+ * point straight into the inflate window. i is a multiple of bpp, so a
+ * row can be processed in strips. */
+
+typedef void (*sped_unfilter_fn)(uint8_t *dst, const uint8_t *src,
+                                 const uint8_t *prev, int i, int n);
+
+static void unfilter_none(uint8_t *dst, const uint8_t *src,
+                          const uint8_t *prev, int i, int n)
+{
+    (void)prev;
+    if (dst != src) memcpy(dst + i, src + i, (size_t)(n - i));
+}
+
+static void unfilter_up(uint8_t *dst, const uint8_t *src,
+                        const uint8_t *prev, int i, int n)
+{
+    for (; i < n; i++) dst[i] = (uint8_t)(src[i] + prev[i]);
+}
+
+/* Scalar Sub/Average/Paeth with bpp as a compile-time constant, so the
+ * left-neighbour distance folds into the addressing and the first-pixel
+ * special case leaves the inner loop. */
+#define SPED_UNFILTER_SCALAR(N)                                              \
+static void unfilter_sub_##N(uint8_t *dst, const uint8_t *src,               \
+                             const uint8_t *prev, int i, int n)              \
+{                                                                            \
+    (void)prev;                                                              \
+    for (; i < N && i < n; i++) dst[i] = src[i];                             \
+    for (; i < n; i++) dst[i] = (uint8_t)(src[i] + dst[i - N]);              \
+}                                                                            \
+static void unfilter_avg_##N(uint8_t *dst, const uint8_t *src,               \
+                             const uint8_t *prev, int i, int n)              \
+{                                                                            \
+    for (; i < N && i < n; i++) dst[i] = (uint8_t)(src[i] + (prev[i] >> 1)); \
+    for (; i < n; i++)                                                       \
+        dst[i] = (uint8_t)(src[i] + ((dst[i - N] + prev[i]) >> 1));          \
+}                                                                            \
+static void unfilter_paeth_##N(uint8_t *dst, const uint8_t *src,             \
+                               const uint8_t *prev, int i, int n)            \
+{                                                                            \
+    for (; i < N && i < n; i++) dst[i] = (uint8_t)(src[i] + prev[i]);        \
+    for (; i < n; i++)                                                       \
+        dst[i] = (uint8_t)(src[i] + paeth(dst[i - N], prev[i], prev[i - N])); \
+}
+
+SPED_UNFILTER_SCALAR(1)
+SPED_UNFILTER_SCALAR(2)
+SPED_UNFILTER_SCALAR(3)
+SPED_UNFILTER_SCALAR(4)
+SPED_UNFILTER_SCALAR(6)
+SPED_UNFILTER_SCALAR(8)
+
+#ifdef SPED_SSE2
+/* SSE2 kernels: one whole pixel (bpp <= 8 bytes) per register, so the
+ * serial left-neighbour dependency costs one vector op per pixel instead
+ * of one scalar op per byte. Paeth runs in 16-bit lanes. */
+static inline __m128i sse_load(const uint8_t *p, int n)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, (size_t)n);
+    return _mm_loadl_epi64((const __m128i *)&v);
+}
+
+static inline void sse_store(uint8_t *p, __m128i x, int n)
+{
+    uint64_t v;
+    _mm_storel_epi64((__m128i *)&v, x);
+    memcpy(p, &v, (size_t)n);
+}
+
+static void unfilter_up_sse2(uint8_t *dst, const uint8_t *src,
+                             const uint8_t *prev, int i, int n)
+{
+    for (; i + 16 <= n; i += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi8(c, b));
+    }
+    for (; i < n; i++) dst[i] = (uint8_t)(src[i] + prev[i]);
+}
+
+#define SPED_UNFILTER_SSE2(N)                                                \
+static void unfilter_sub_##N##_sse2(uint8_t *dst, const uint8_t *src,        \
+                                    const uint8_t *prev, int i, int n)       \
+{                                                                            \
+    __m128i a = i ? sse_load(dst + i - N, N) : _mm_setzero_si128();          \
+    (void)prev;                                                              \
+    for (; i < n; i += N) {                                                  \
+        a = _mm_add_epi8(a, sse_load(src + i, N));                           \
+        sse_store(dst + i, a, N);                                            \
+    }                                                                        \
+}                                                                            \
+static void unfilter_avg_##N##_sse2(uint8_t *dst, const uint8_t *src,        \
+                                    const uint8_t *prev, int i, int n)       \
+{                                                                            \
+    const __m128i one = _mm_set1_epi8(1);                                    \
+    __m128i a = i ? sse_load(dst + i - N, N) : _mm_setzero_si128();          \
+    for (; i < n; i += N) {                                                  \
+        __m128i b = sse_load(prev + i, N);                                   \
+        /* pavgb rounds up; drop the carry to get floor((a + b) / 2) */      \
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),                       \
+                          _mm_and_si128(_mm_xor_si128(a, b), one));          \
+        a = _mm_add_epi8(avg, sse_load(src + i, N));                         \
+        sse_store(dst + i, a, N);                                            \
+    }                                                                        \
+}                                                                            \
+static void unfilter_paeth_##N##_sse2(uint8_t *dst, const uint8_t *src,      \
+                                      const uint8_t *prev, int i, int n)     \
+{                                                                            \
+    const __m128i zero = _mm_setzero_si128();                                \
+    __m128i a = zero, c = zero;                                              \
+    if (i) {                                                                 \
+        a = _mm_unpacklo_epi8(sse_load(dst + i - N, N), zero);               \
+        c = _mm_unpacklo_epi8(sse_load(prev + i - N, N), zero);              \
+    }                                                                        \
+    for (; i < n; i += N) {                                                  \
+        __m128i b = _mm_unpacklo_epi8(sse_load(prev + i, N), zero);          \
+        __m128i d = _mm_unpacklo_epi8(sse_load(src + i, N), zero);           \
+        /* |p-a| = |b-c|, |p-b| = |a-c|, |p-c| = |(b-c) + (a-c)| */          \
+        __m128i pa = _mm_sub_epi16(b, c);                                    \
+        __m128i pb = _mm_sub_epi16(a, c);                                    \
+        __m128i pc = _mm_add_epi16(pa, pb);                                  \
+        pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));                     \
+        pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));                     \
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));                     \
+        __m128i m = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));                \
+        __m128i use_a = _mm_cmpeq_epi16(m, pa);                              \
+        __m128i use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(m, pb));     \
+        __m128i pred = _mm_or_si128(_mm_and_si128(use_a, a),                 \
+                       _mm_or_si128(_mm_and_si128(use_b, b),                 \
+                       _mm_andnot_si128(_mm_or_si128(use_a, use_b), c)));    \
+        /* byte adds keep the zero high halves, i.e. sum mod 256 */          \
+        a = _mm_add_epi8(pred, d);                                           \
+        c = b;                                                               \
+        sse_store(dst + i, _mm_packus_epi16(a, a), N);                       \
+    }                                                                        \
+}
+
+SPED_UNFILTER_SSE2(3)
+SPED_UNFILTER_SSE2(4)
+SPED_UNFILTER_SSE2(6)
+SPED_UNFILTER_SSE2(8)
+#endif /* SPED_SSE2 */
+
+#ifdef SPED_X86_DISPATCH
+__attribute__((target("avx2")))
+static void unfilter_up_avx2(uint8_t *dst, const uint8_t *src,
+                             const uint8_t *prev, int i, int n)
+{
+    for (; i + 32 <= n; i += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi8(c, b));
+    }
+    for (; i < n; i++) dst[i] = (uint8_t)(src[i] + prev[i]);
+}
+#endif
+
+/* Fill unf[0..4] (indexed by filter type) with the best kernels for this
+ * bpp on the running CPU. */
+static void unfilter_select(sped_unfilter_fn unf[5], int bpp)
+{
+    unf[0] = unfilter_none;
+    unf[2] = unfilter_up;
+    switch (bpp) {
+        case 1: unf[1] = unfilter_sub_1; unf[3] = unfilter_avg_1; unf[4] = unfilter_paeth_1; break;
+        case 2: unf[1] = unfilter_sub_2; unf[3] = unfilter_avg_2; unf[4] = unfilter_paeth_2; break;
+        case 3: unf[1] = unfilter_sub_3; unf[3] = unfilter_avg_3; unf[4] = unfilter_paeth_3; break;
+        case 4: unf[1] = unfilter_sub_4; unf[3] = unfilter_avg_4; unf[4] = unfilter_paeth_4; break;
+        case 6: unf[1] = unfilter_sub_6; unf[3] = unfilter_avg_6; unf[4] = unfilter_paeth_6; break;
+        default: unf[1] = unfilter_sub_8; unf[3] = unfilter_avg_8; unf[4] = unfilter_paeth_8; break;
+    }
+#ifdef SPED_SSE2
+    unf[2] = unfilter_up_sse2;
+    switch (bpp) {
+        case 3: unf[1] = unfilter_sub_3_sse2; unf[3] = unfilter_avg_3_sse2; unf[4] = unfilter_paeth_3_sse2; break;
+        case 4: unf[1] = unfilter_sub_4_sse2; unf[3] = unfilter_avg_4_sse2; unf[4] = unfilter_paeth_4_sse2; break;
+        case 6: unf[1] = unfilter_sub_6_sse2; unf[3] = unfilter_avg_6_sse2; unf[4] = unfilter_paeth_6_sse2; break;
+        case 8: unf[1] = unfilter_sub_8_sse2; unf[3] = unfilter_avg_8_sse2; unf[4] = unfilter_paeth_8_sse2; break;
+    }
+#endif
+#ifdef SPED_X86_DISPATCH
+    if (sped_cpu() & SPED_CPU_AVX2) unf[2] = unfilter_up_avx2;
+#endif
+}
+
+/* ---- RGB565 row converters ----
+ *
+ * Convert n pixels of a reconstructed scanline straight into the output
+ * row. One converter per (color type, depth), picked once per image by
+ * convert_select(). 16-bit samples keep their high (first) byte. */
+
+typedef void (*sped_convert_fn)(uint16_t *out, const uint8_t *src, uint32_t n,
+                                const uint16_t *lut);
+
+static inline uint16_t rgb565(uint8_t r, uint8_t g, uint8_t b)
+{
+    return (uint16_t)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
+}
+
+/* S = bytes per pixel, R/G/B = byte offsets of each channel's high byte */
+#define SPED_CONVERT_SCALAR(NAME, S, R, G, B)                                \
+static void convert_##NAME(uint16_t *out, const uint8_t *src, uint32_t n,    \
+                           const uint16_t *lut)                              \
+{                                                                            \
+    (void)lut;                                                               \
+    for (uint32_t x = 0; x < n; x++, src += S)                               \
+        out[x] = rgb565(src[R], src[G], src[B]);                             \
+}
+
+/* Gray and palette pixels have at most 256 distinct colors: one lookup
+ * in the image's RGB565 table (see lut_build) per pixel. */
+#define SPED_CONVERT_LUT(NAME, S)                                            \
+static void convert_##NAME(uint16_t *out, const uint8_t *src, uint32_t n,    \
+                           const uint16_t *lut)                              \
+{                                                                            \
+    for (uint32_t x = 0; x < n; x++, src += S)                               \
+        out[x] = lut[*src];                                                  \
+}
+
+SPED_CONVERT_LUT(gray8,     1)
+SPED_CONVERT_LUT(ga8,       2)
+SPED_CONVERT_SCALAR(rgb8,   3, 0, 1, 2)
+SPED_CONVERT_SCALAR(rgba8,  4, 0, 1, 2)
+SPED_CONVERT_LUT(gray16,    2)
+SPED_CONVERT_LUT(ga16,      4)
+SPED_CONVERT_SCALAR(rgb16,  6, 0, 2, 4)
+SPED_CONVERT_SCALAR(rgba16, 8, 0, 2, 4)
+SPED_CONVERT_LUT(pal8,      1)
+
+/* Build the RGB565 table for gray levels or palette entries. The spare
+ * 257th entry lets a 32-bit gather at index 255 stay in bounds. */
+static void lut_build(uint16_t lut[257], uint8_t ctype, const uint8_t pal[][3])
+{
+    for (int i = 0; i < 256; i++)
+        lut[i] = (ctype == 3) ? rgb565(pal[i][0], pal[i][1], pal[i][2])
+                              : rgb565((uint8_t)i, (uint8_t)i, (uint8_t)i);
+    lut[256] = 0;
+}
+
+#ifdef SPED_SSE2
+/* 4 x (R,G,B,x) bytes in 32-bit lanes -> 4 x RGB565 in the low halves */
+static inline __m128i sse_rgbx_565(__m128i v)
+{
+    __m128i r = _mm_and_si128(_mm_slli_epi32(v, 8),  _mm_set1_epi32(0xF800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(v, 5),  _mm_set1_epi32(0x07E0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(v, 19), _mm_set1_epi32(0x001F));
+    return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+/* Narrow 2 x 4 32-bit lanes to 8 x 16-bit without saturating: sign-extend
+ * the low half first so packs_epi32 passes the bit pattern through. */
+static inline __m128i sse_pack_565(__m128i lo, __m128i hi)
+{
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    return _mm_packs_epi32(lo, hi);
+}
+
+/* 8 x gray (0..255) in 16-bit lanes -> 8 x RGB565 */
+static inline __m128i sse_gray_565(__m128i v)
+{
+    __m128i r = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xF8)), 8);
+    __m128i g = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xFC)), 3);
+    return _mm_or_si128(_mm_or_si128(r, g), _mm_srli_epi16(v, 3));
+}
+
+static inline __m128i sse_loadu(const uint8_t *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+static void convert_gray8_sse2(uint16_t *out, const uint8_t *src, uint32_t n,
+                               const uint16_t *lut)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i v = sse_loadu(src + x);
+        _mm_storeu_si128((__m128i *)(out + x),     sse_gray_565(_mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128((__m128i *)(out + x + 8), sse_gray_565(_mm_unpackhi_epi8(v, zero)));
+    }
+    convert_gray8(out + x, src + x, n - x, lut);
+}
+
+static void convert_ga8_sse2(uint16_t *out, const uint8_t *src, uint32_t n,
+                             const uint16_t *lut)
+{
+    const __m128i lo8 = _mm_set1_epi16(0x00FF);
+    uint32_t x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v = _mm_and_si128(sse_loadu(src + x * 2), lo8);
+        _mm_storeu_si128((__m128i *)(out + x), sse_gray_565(v));
+    }
+    convert_ga8(out + x, src + x * 2, n - x, lut);
+}
+
+static void convert_rgba8_sse2(uint16_t *out, const uint8_t *src, uint32_t n,
+                               const uint16_t *lut)
+{
+    uint32_t x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i a = sse_rgbx_565(sse_loadu(src + x * 4));
+        __m128i b = sse_rgbx_565(sse_loadu(src + x * 4 + 16));
+        _mm_storeu_si128((__m128i *)(out + x), sse_pack_565(a, b));
+    }
+    convert_rgba8(out + x, src + x * 4, n - x, lut);
+}
+
+/* 16-bit samples are big-endian, so each high byte is the low byte of a
+ * little-endian 16-bit lane: masking with 0x00FF narrows in place. */
+static void convert_gray16_sse2(uint16_t *out, const uint8_t *src, uint32_t n,
+                                const uint16_t *lut)
+{
+    const __m128i lo8 = _mm_set1_epi16(0x00FF);
+    uint32_t x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v = _mm_and_si128(sse_loadu(src + x * 2), lo8);
+        _mm_storeu_si128((__m128i *)(out + x), sse_gray_565(v));
+    }
+    convert_gray16(out + x, src + x * 2, n - x, lut);
+}
+
+static void convert_ga16_sse2(uint16_t *out, const uint8_t *src, uint32_t n,
+                              const uint16_t *lut)
+{
+    const __m128i lo8 = _mm_set1_epi32(0x000000FF);
+    uint32_t x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i a = _mm_and_si128(sse_loadu(src + x * 4), lo8);
+        __m128i b = _mm_and_si128(sse_loadu(src + x * 4 + 16), lo8);
+        _mm_storeu_si128((__m128i *)(out + x), sse_gray_565(_mm_packs_epi32(a, b)));
+    }
+    convert_ga16(out + x, src + x * 4, n - x, lut);
+}
+
+static void convert_rgba16_sse2(uint16_t *out, const uint8_t *src, uint32_t n,
+                                const uint16_t *lut)
+{
+    const __m128i lo8 = _mm_set1_epi16(0x00FF);
+    uint32_t x = 0;
+    for (; x + 8 <= n; x += 8) {
+        const uint8_t *p = src + x * 8;
+        __m128i a = _mm_packus_epi16(_mm_and_si128(sse_loadu(p), lo8),
+                                     _mm_and_si128(sse_loadu(p + 16), lo8));
+        __m128i b = _mm_packus_epi16(_mm_and_si128(sse_loadu(p + 32), lo8),
+                                     _mm_and_si128(sse_loadu(p + 48), lo8));
+        _mm_storeu_si128((__m128i *)(out + x),
+                         sse_pack_565(sse_rgbx_565(a), sse_rgbx_565(b)));
+    }
+    convert_rgba16(out + x, src + x * 8, n - x, lut);
+}
+#endif /* SPED_SSE2 */
+
+#ifdef SPED_X86_DISPATCH
+/* RGB layouts need a byte shuffle to line pixels up on 32-bit lanes.
+ * Loads are 16 bytes wide but only 12 are used, so the loops stop early
+ * enough never to read past the end of the scanline. */
+__attribute__((target("ssse3")))
+static void convert_rgb8_ssse3(uint16_t *out, const uint8_t *src, uint32_t n,
+                               const uint16_t *lut)
+{
+    const __m128i shuf = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                       6, 7, 8, -1, 9, 10, 11, -1);
+    uint32_t x = 0;
+    for (; x + 10 <= n; x += 8) {
+        const uint8_t *p = src + x * 3;
+        __m128i a = _mm_shuffle_epi8(sse_loadu(p), shuf);
+        __m128i b = _mm_shuffle_epi8(sse_loadu(p + 12), shuf);
+        _mm_storeu_si128((__m128i *)(out + x),
+                         sse_pack_565(sse_rgbx_565(a), sse_rgbx_565(b)));
+    }
+    convert_rgb8(out + x, src + x * 3, n - x, lut);
+}
+
+__attribute__((target("ssse3")))
+static void convert_rgb16_ssse3(uint16_t *out, const uint8_t *src, uint32_t n,
+                                const uint16_t *lut)
+{
+    /* two 6-byte pixels per load -> (R,G,B,x) in the low 64 bits */
+    const __m128i shuf = _mm_setr_epi8(0, 2, 4, -1, 6, 8, 10, -1,
+                                       -1, -1, -1, -1, -1, -1, -1, -1);
+    uint32_t x = 0;
+    for (; x + 9 <= n; x += 8) {
+        const uint8_t *p = src + x * 6;
+        __m128i a = _mm_unpacklo_epi64(_mm_shuffle_epi8(sse_loadu(p), shuf),
+                                       _mm_shuffle_epi8(sse_loadu(p + 12), shuf));
+        __m128i b = _mm_unpacklo_epi64(_mm_shuffle_epi8(sse_loadu(p + 24), shuf),
+                                       _mm_shuffle_epi8(sse_loadu(p + 36), shuf));
+        _mm_storeu_si128((__m128i *)(out + x),
+                         sse_pack_565(sse_rgbx_565(a), sse_rgbx_565(b)));
+    }
+    convert_rgb16(out + x, src + x * 6, n - x, lut);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx_rgbx_565(__m256i v)
+{
+    __m256i r = _mm256_and_si256(_mm256_slli_epi32(v, 8),  _mm256_set1_epi32(0xF800));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 5),  _mm256_set1_epi32(0x07E0));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 19), _mm256_set1_epi32(0x001F));
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+/* packs works per 128-bit lane; the permute restores pixel order */
+__attribute__((target("avx2")))
+static inline __m256i avx_pack_565(__m256i lo, __m256i hi)
+{
+    lo = _mm256_srai_epi32(_mm256_slli_epi32(lo, 16), 16);
+    hi = _mm256_srai_epi32(_mm256_slli_epi32(hi, 16), 16);
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx_gray_565(__m256i v)
+{
+    __m256i r = _mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xF8)), 8);
+    __m256i g = _mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0xFC)), 3);
+    return _mm256_or_si256(_mm256_or_si256(r, g), _mm256_srli_epi16(v, 3));
+}
+
+__attribute__((target("avx2")))
+static void convert_gray8_avx2(uint16_t *out, const uint8_t *src, uint32_t n,
+                               const uint16_t *lut)
+{
+    uint32_t x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i a = _mm256_cvtepu8_epi16(sse_loadu(src + x));
+        __m256i b = _mm256_cvtepu8_epi16(sse_loadu(src + x + 16));
+        _mm256_storeu_si256((__m256i *)(out + x),      avx_gray_565(a));
+        _mm256_storeu_si256((__m256i *)(out + x + 16), avx_gray_565(b));
+    }
+    convert_gray8_sse2(out + x, src + x, n - x, lut);
+}
+
+__attribute__((target("avx2")))
+static void convert_ga8_avx2(uint16_t *out, const uint8_t *src, uint32_t n,
+                             const uint16_t *lut)
+{
+    const __m256i lo8 = _mm256_set1_epi16(0x00FF);
+    uint32_t x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + x * 2));
+        _mm256_storeu_si256((__m256i *)(out + x), avx_gray_565(_mm256_and_si256(v, lo8)));
+    }
+    convert_ga8_sse2(out + x, src + x * 2, n - x, lut);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgba8_avx2(uint16_t *out, const uint8_t *src, uint32_t n,
+                               const uint16_t *lut)
+{
+    uint32_t x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + x * 4 + 32));
+        _mm256_storeu_si256((__m256i *)(out + x),
+                            avx_pack_565(avx_rgbx_565(a), avx_rgbx_565(b)));
+    }
+    convert_rgba8_sse2(out + x, src + x * 4, n - x, lut);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgb8_avx2(uint16_t *out, const uint8_t *src, uint32_t n,
+                              const uint16_t *lut)
+{
+    const __m256i shuf = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1,
+                                          0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1);
+    uint32_t x = 0;
+    for (; x + 18 <= n; x += 16) {
+        const uint8_t *p = src + x * 3;
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(sse_loadu(p)),
+                                            sse_loadu(p + 12), 1);
+        __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(sse_loadu(p + 24)),
+                                            sse_loadu(p + 36), 1);
+        a = avx_rgbx_565(_mm256_shuffle_epi8(a, shuf));
+        b = avx_rgbx_565(_mm256_shuffle_epi8(b, shuf));
+        _mm256_storeu_si256((__m256i *)(out + x), avx_pack_565(a, b));
+    }
+    convert_rgb8_ssse3(out + x, src + x * 3, n - x, lut);
+}
+/* Palette via 32-bit gathers from the 16-bit table (scale 2 = byte
+ * offset 2 * idx); the upper half of each lane is the neighbour entry
+ * and is dropped by the pack. */
+__attribute__((target("avx2")))
+static void convert_pal8_avx2(uint16_t *out, const uint8_t *src, uint32_t n,
+                              const uint16_t *lut)
+{
+    const int *base = (const int *)(const void *)lut;
+    uint32_t x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i i0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+        __m256i i1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x + 8)));
+        __m256i a = _mm256_i32gather_epi32(base, i0, 2);
+        __m256i b = _mm256_i32gather_epi32(base, i1, 2);
+        _mm256_storeu_si256((__m256i *)(out + x), avx_pack_565(a, b));
+    }
+    convert_pal8(out + x, src + x, n - x, lut);
+}
+#endif /* SPED_X86_DISPATCH */
+
+/* Pick the converter for this format on the running CPU */
+static sped_convert_fn convert_select(uint8_t ctype, int bpc)
+{
+    int wide = (bpc == 2);
+    sped_convert_fn fn;
+    switch (ctype) {
+        case 0:  fn = wide ? convert_gray16 : convert_gray8; break;
+        case 2:  fn = wide ? convert_rgb16  : convert_rgb8;  break;
+        case 3:  fn = convert_pal8; break;
+        case 4:  fn = wide ? convert_ga16   : convert_ga8;   break;
+        default: fn = wide ? convert_rgba16 : convert_rgba8; break;
+    }
+#ifdef SPED_SSE2
+    switch (ctype) {
+        case 0: fn = wide ? convert_gray16_sse2 : convert_gray8_sse2; break;
+        case 4: fn = wide ? convert_ga16_sse2   : convert_ga8_sse2;   break;
+        case 6: fn = wide ? convert_rgba16_sse2 : convert_rgba8_sse2; break;
+    }
+#endif
+#ifdef SPED_X86_DISPATCH
+    int cpu = sped_cpu();
+    if ((cpu & SPED_CPU_SSSE3) && ctype == 2)
+        fn = wide ? convert_rgb16_ssse3 : convert_rgb8_ssse3;
+    if ((cpu & SPED_CPU_AVX2) && !wide && (cpu & SPED_CPU_SSSE3)) {
+        switch (ctype) {
+            case 0: fn = convert_gray8_avx2; break;
+            case 2: fn = convert_rgb8_avx2;  break;
+            case 4: fn = convert_ga8_avx2;   break;
+            case 6: fn = convert_rgba8_avx2; break;
+        }
+    }
+    if ((cpu & SPED_CPU_AVX2) && ctype == 3)
+        fn = convert_pal8_avx2;
+#endif
+    return fn;
+}
+
+/* ---- Box downscale kernels ----
+ *
+ * 1/2 and 1/4 scale in two steps. A horizontal kernel adds each run of
+ * SCALE pixels straight from the reconstructed channel bytes into its
+ * output pixel's 16-bit sums in acc: 4 lanes (R, G, B, 0) for color and
+ * palette images, 1 for gray ones, so 8 lanes of sums are a whole
+ * number of pixels. Every SCALE rows an emit kernel divides the sums (a
+ * shift), packs them to RGB565 and clears them. Both are picked once
+ * per image by box_select(). */
+
+typedef void (*sped_hsum_fn)(uint16_t *acc, const uint8_t *src, uint32_t n,
+                             const uint8_t (*pal)[3]);
+typedef void (*sped_emit_fn)(uint16_t *out, uint16_t *acc, uint32_t n, int shift);
+
+/* n output pixels from n * SCALE source pixels. S is bytes per pixel,
+ * R/G/B are the channel byte offsets, PAL selects palette lookup, NC is
+ * lanes per output pixel. */
+SPED_TEMPLATE void hsum_px(uint16_t *acc, const uint8_t *src, uint32_t n,
+                           const uint8_t (*pal)[3], const int S, const int R,
+                           const int G, const int B, const int PAL,
+                           const int NC, const int SCALE)
+{
+    for (uint32_t x = 0; x < n; x++, acc += NC) {
+        unsigned r = 0, g = 0, b = 0;
+        for (int k = 0; k < SCALE; k++, src += S) {
+            if (PAL) {
+                const uint8_t *c = pal[*src];
+                r += c[0]; g += c[1]; b += c[2];
+            } else {
+                r += src[R];
+                if (NC > 1) { g += src[G]; b += src[B]; }
+            }
+        }
+        acc[0] += (uint16_t)r;
+        if (NC > 1) {
+            acc[1] += (uint16_t)g;
+            acc[2] += (uint16_t)b;
+        }
+    }
+}
+
+#define SPED_HSUM(NAME, S, R, G, B, PAL, NC)                                  \
+static void hsum_##NAME##_x2(uint16_t *acc, const uint8_t *src, uint32_t n,   \
+                             const uint8_t (*pal)[3])                         \
+{ hsum_px(acc, src, n, pal, S, R, G, B, PAL, NC, 2); }                        \
+static void hsum_##NAME##_x4(uint16_t *acc, const uint8_t *src, uint32_t n,   \
+                             const uint8_t (*pal)[3])                         \
+{ hsum_px(acc, src, n, pal, S, R, G, B, PAL, NC, 4); }
+
+SPED_HSUM(gray8,  1, 0, 0, 0, 0, 1)
+SPED_HSUM(ga8,    2, 0, 0, 0, 0, 1)
+SPED_HSUM(rgb8,   3, 0, 1, 2, 0, 4)
+SPED_HSUM(rgba8,  4, 0, 1, 2, 0, 4)
+SPED_HSUM(gray16, 2, 0, 0, 0, 0, 1)
+SPED_HSUM(ga16,   4, 0, 0, 0, 0, 1)
+SPED_HSUM(rgb16,  6, 0, 2, 4, 0, 4)
+SPED_HSUM(rgba16, 8, 0, 2, 4, 0, 4)
+SPED_HSUM(pal8,   1, 0, 0, 0, 1, 4)
+
+static void emit_gray(uint16_t *out, uint16_t *acc, uint32_t n, int shift)
+{
+    for (uint32_t x = 0; x < n; x++) {
+        uint8_t v = (uint8_t)(acc[x] >> shift);
+        out[x] = rgb565(v, v, v);
+        acc[x] = 0;
+    }
+}
+
+static void emit_rgbx(uint16_t *out, uint16_t *acc, uint32_t n, int shift)
+{
+    for (uint32_t x = 0; x < n; x++, acc += 4) {
+        out[x] = rgb565((uint8_t)(acc[0] >> shift), (uint8_t)(acc[1] >> shift),
+                        (uint8_t)(acc[2] >> shift));
+        acc[0] = acc[1] = acc[2] = acc[3] = 0;
+    }
+}
+
+#ifdef SPED_SSE2
+static void emit_gray_sse2(uint16_t *out, uint16_t *acc, uint32_t n, int shift)
+{
+    const __m128i sh = _mm_cvtsi32_si128(shift), zero = _mm_setzero_si128();
+    uint32_t x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v = _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(acc + x)), sh);
+        _mm_storeu_si128((__m128i *)(out + x), sse_gray_565(v));
+        _mm_storeu_si128((__m128i *)(acc + x), zero);
+    }
+    emit_gray(out + x, acc + x, n - x, shift);
+}
+
+/* Averages of 4 pixels pack to bytes as R, G, B, x in 32-bit lanes,
+ * which sse_rgbx_565 takes */
+static void emit_rgbx_sse2(uint16_t *out, uint16_t *acc, uint32_t n, int shift)
+{
+    const __m128i sh = _mm_cvtsi32_si128(shift), zero = _mm_setzero_si128();
+    uint32_t x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i *a = (__m128i *)(acc + x * 4);
+        __m128i lo = _mm_packus_epi16(_mm_srl_epi16(_mm_loadu_si128(a), sh),
+                                      _mm_srl_epi16(_mm_loadu_si128(a + 1), sh));
+        __m128i hi = _mm_packus_epi16(_mm_srl_epi16(_mm_loadu_si128(a + 2), sh),
+                                      _mm_srl_epi16(_mm_loadu_si128(a + 3), sh));
+        _mm_storeu_si128((__m128i *)(out + x),
+                         sse_pack_565(sse_rgbx_565(lo), sse_rgbx_565(hi)));
+        _mm_storeu_si128(a, zero);
+        _mm_storeu_si128(a + 1, zero);
+        _mm_storeu_si128(a + 2, zero);
+        _mm_storeu_si128(a + 3, zero);
+    }
+    emit_rgbx(out + x, acc + x * 4, n - x, shift);
+}
+#endif /* SPED_SSE2 */
+
+#ifdef SPED_X86_DISPATCH
+/* SSSE3: pshufb moves each channel's (high) byte into a 16-bit lane
+ * with mask m, giving 8 gray or 2 color pixels per vector. m2 takes the
+ * next 2 color pixels from the same load when 8-bit ones fit 4 to a
+ * load, and the upper gray lanes from a second load for ga16. Adjacent
+ * pixels are then added in the register: gray with phaddw, color by
+ * adding the two 64-bit halves. Each step adds 8 lanes of sums to acc;
+ * the scalar kernel (tail) finishes the row, and takes any step that
+ * would read past the n * SCALE pixels. */
+SPED_TEMPLATE __attribute__((target("ssse3")))
+void hsum_ssse3(uint16_t *acc, const uint8_t *src, uint32_t n,
+                const uint8_t (*pal)[3], const int S, const int NC,
+                const int SCALE, const __m128i m, const __m128i m2,
+                sped_hsum_fn tail)
+{
+    const uint32_t step = 8 / NC;   /* output pixels per step */
+    const uint32_t over = NC == 1 ? (8 * S < 16 ? 16 - 8 * S : 0) :
+                          S <= 4 ? 16 - 4 * S : 16 - 2 * S;
+    uint32_t x = 0;
+    for (; x + step <= n && (n - x - step) * SCALE * S >= over; x += step) {
+        const uint8_t *p = src + x * SCALE * S;
+        __m128i o;
+        if (NC == 1) {
+            __m128i v[4];
+            for (int k = 0; k < SCALE; k++) {
+                const uint8_t *q = p + k * 8 * S;
+                v[k] = _mm_shuffle_epi8(sse_loadu(q), m);
+                if (S == 4) v[k] = _mm_or_si128(v[k], _mm_shuffle_epi8(sse_loadu(q + 16), m2));
+            }
+            o = _mm_hadd_epi16(v[0], v[1]);
+            if (SCALE == 4) o = _mm_hadd_epi16(o, _mm_hadd_epi16(v[2], v[3]));
+        } else {
+            __m128i s0, s1;
+            if (S <= 4) {
+                __m128i v = sse_loadu(p);
+                s0 = _mm_shuffle_epi8(v, m);
+                s1 = _mm_shuffle_epi8(v, m2);
+                if (SCALE == 4) {
+                    v = sse_loadu(p + 4 * S);
+                    s0 = _mm_add_epi16(s0, s1);
+                    s1 = _mm_add_epi16(_mm_shuffle_epi8(v, m), _mm_shuffle_epi8(v, m2));
+                }
+            } else {
+                s0 = _mm_shuffle_epi8(sse_loadu(p), m);
+                s1 = _mm_shuffle_epi8(sse_loadu(p + SCALE * S), m);
+                if (SCALE == 4) {
+                    s0 = _mm_add_epi16(s0, _mm_shuffle_epi8(sse_loadu(p + 2 * S), m));
+                    s1 = _mm_add_epi16(s1, _mm_shuffle_epi8(sse_loadu(p + 6 * S), m));
+                }
+            }
+            s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+            s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+            o = _mm_unpacklo_epi64(s0, s1);
+        }
+        __m128i *a = (__m128i *)(acc + x * NC);
+        _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), o));
+    }
+    tail(acc + x * NC, src + x * SCALE * S, n - x, pal);
+}
+
+/* pshufb mask: lane i takes byte b_i, -1 = zero */
+#define SPED_LANES(b0, b1, b2, b3, b4, b5, b6, b7)                            \
+    _mm_setr_epi8(b0, -1, b1, -1, b2, -1, b3, -1, b4, -1, b5, -1, b6, -1, b7, -1)
+
+#define SPED_HSUM_SSSE3(NAME, S, NC, M, M2)                                   \
+__attribute__((target("ssse3")))                                              \
+static void hsum_##NAME##_x2_ssse3(uint16_t *acc, const uint8_t *src,         \
+                                   uint32_t n, const uint8_t (*pal)[3])       \
+{ hsum_ssse3(acc, src, n, pal, S, NC, 2, M, M2, hsum_##NAME##_x2); }          \
+__attribute__((target("ssse3")))                                              \
+static void hsum_##NAME##_x4_ssse3(uint16_t *acc, const uint8_t *src,         \
+                                   uint32_t n, const uint8_t (*pal)[3])       \
+{ hsum_ssse3(acc, src, n, pal, S, NC, 4, M, M2, hsum_##NAME##_x4); }
+
+SPED_HSUM_SSSE3(gray8,  1, 1, SPED_LANES(0, 1, 2, 3, 4, 5, 6, 7), _mm_setzero_si128())
+SPED_HSUM_SSSE3(ga8,    2, 1, SPED_LANES(0, 2, 4, 6, 8, 10, 12, 14), _mm_setzero_si128())
+SPED_HSUM_SSSE3(gray16, 2, 1, SPED_LANES(0, 2, 4, 6, 8, 10, 12, 14), _mm_setzero_si128())
+SPED_HSUM_SSSE3(ga16,   4, 1, SPED_LANES(0, 4, 8, 12, -1, -1, -1, -1),
+                              SPED_LANES(-1, -1, -1, -1, 0, 4, 8, 12))
+SPED_HSUM_SSSE3(rgb8,   3, 4, SPED_LANES(0, 1, 2, -1, 3, 4, 5, -1),
+                              SPED_LANES(6, 7, 8, -1, 9, 10, 11, -1))
+SPED_HSUM_SSSE3(rgba8,  4, 4, SPED_LANES(0, 1, 2, -1, 4, 5, 6, -1),
+                              SPED_LANES(8, 9, 10, -1, 12, 13, 14, -1))
+SPED_HSUM_SSSE3(rgb16,  6, 4, SPED_LANES(0, 2, 4, -1, 6, 8, 10, -1), _mm_setzero_si128())
+SPED_HSUM_SSSE3(rgba16, 8, 4, SPED_LANES(0, 2, 4, -1, 8, 10, 12, -1), _mm_setzero_si128())
+
+/* AVX2, 8-bit color: the SSSE3 color step in each 128-bit lane, the
+ * lanes 2 * SCALE pixels apart, for 4 output pixels a step */
+SPED_TEMPLATE __attribute__((target("avx2")))
+void hsum_avx2(uint16_t *acc, const uint8_t *src, uint32_t n,
+               const uint8_t (*pal)[3], const int S, const int SCALE,
+               const __m256i m, const __m256i m2, sped_hsum_fn tail)
+{
+    const uint32_t over = 16 - 4 * S;
+    const int L = 2 * SCALE * S;   /* bytes between the lanes */
+    uint32_t x = 0;
+    for (; x + 4 <= n && (n - x - 4) * SCALE * S >= over; x += 4) {
+        const uint8_t *p = src + x * SCALE * S;
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(sse_loadu(p)),
+                                            sse_loadu(p + L), 1);
+        __m256i s0 = _mm256_shuffle_epi8(v, m), s1 = _mm256_shuffle_epi8(v, m2);
+        if (SCALE == 4) {
+            v = _mm256_inserti128_si256(_mm256_castsi128_si256(sse_loadu(p + 4 * S)),
+                                        sse_loadu(p + L + 4 * S), 1);
+            s0 = _mm256_add_epi16(s0, s1);
+            s1 = _mm256_add_epi16(_mm256_shuffle_epi8(v, m), _mm256_shuffle_epi8(v, m2));
+        }
+        s0 = _mm256_add_epi16(s0, _mm256_srli_si256(s0, 8));
+        s1 = _mm256_add_epi16(s1, _mm256_srli_si256(s1, 8));
+        __m256i *a = (__m256i *)(acc + x * 4);
+        _mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a),
+                                                _mm256_unpacklo_epi64(s0, s1)));
+    }
+    _mm256_zeroupper();   /* the SSE tail is a sibling call, which skips it */
+    tail(acc + x * 4, src + x * SCALE * S, n - x, pal);
+}
+
+#define SPED_LANES2(b0, b1, b2, b3, b4, b5, b6, b7)                           \
+    _mm256_setr_epi8(b0, -1, b1, -1, b2, -1, b3, -1, b4, -1, b5, -1, b6, -1, b7, -1, \
+                     b0, -1, b1, -1, b2, -1, b3, -1, b4, -1, b5, -1, b6, -1, b7, -1)
+
+#define SPED_HSUM_AVX2(NAME, S, M, M2)                                        \
+__attribute__((target("avx2")))                                               \
+static void hsum_##NAME##_x2_avx2(uint16_t *acc, const uint8_t *src,          \
+                                  uint32_t n, const uint8_t (*pal)[3])        \
+{ hsum_avx2(acc, src, n, pal, S, 2, M, M2, hsum_##NAME##_x2_ssse3); }         \
+__attribute__((target("avx2")))                                               \
+static void hsum_##NAME##_x4_avx2(uint16_t *acc, const uint8_t *src,          \
+                                  uint32_t n, const uint8_t (*pal)[3])        \
+{ hsum_avx2(acc, src, n, pal, S, 4, M, M2, hsum_##NAME##_x4_ssse3); }
+
+SPED_HSUM_AVX2(rgb8,  3, SPED_LANES2(0, 1, 2, -1, 3, 4, 5, -1),
+                         SPED_LANES2(6, 7, 8, -1, 9, 10, 11, -1))
+SPED_HSUM_AVX2(rgba8, 4, SPED_LANES2(0, 1, 2, -1, 4, 5, 6, -1),
+                         SPED_LANES2(8, 9, 10, -1, 12, 13, 14, -1))
+#endif /* SPED_X86_DISPATCH */
+
+/* Box kernels for this format and scale (2 or 4) on the running CPU;
+ * returns the lanes per output pixel */
+static int box_select(sped_hsum_fn *hsum, sped_emit_fn *emit, uint8_t ctype,
+                      int bpc, int scale)
+{
+    static const sped_hsum_fn x2[2][7] = {
+        { hsum_gray8_x2,  0, hsum_rgb8_x2,  hsum_pal8_x2, hsum_ga8_x2,  0, hsum_rgba8_x2  },
+        { hsum_gray16_x2, 0, hsum_rgb16_x2, 0,            hsum_ga16_x2, 0, hsum_rgba16_x2 },
+    };
+    static const sped_hsum_fn x4[2][7] = {
+        { hsum_gray8_x4,  0, hsum_rgb8_x4,  hsum_pal8_x4, hsum_ga8_x4,  0, hsum_rgba8_x4  },
+        { hsum_gray16_x4, 0, hsum_rgb16_x4, 0,            hsum_ga16_x4, 0, hsum_rgba16_x4 },
+    };
+    int gray = ctype == 0 || ctype == 4;
+    *hsum = scale == 2 ? x2[bpc - 1][ctype] : x4[bpc - 1][ctype];
+    *emit = gray ? emit_gray : emit_rgbx;
+#ifdef SPED_SSE2
+    *emit = gray ? emit_gray_sse2 : emit_rgbx_sse2;
+#endif
+#ifdef SPED_X86_DISPATCH
+    static const sped_hsum_fn s2[2][7] = {
+        { hsum_gray8_x2_ssse3,  0, hsum_rgb8_x2_ssse3,  0, hsum_ga8_x2_ssse3,  0, hsum_rgba8_x2_ssse3  },
+        { hsum_gray16_x2_ssse3, 0, hsum_rgb16_x2_ssse3, 0, hsum_ga16_x2_ssse3, 0, hsum_rgba16_x2_ssse3 },
+    };
+    static const sped_hsum_fn s4[2][7] = {
+        { hsum_gray8_x4_ssse3,  0, hsum_rgb8_x4_ssse3,  0, hsum_ga8_x4_ssse3,  0, hsum_rgba8_x4_ssse3  },
+        { hsum_gray16_x4_ssse3, 0, hsum_rgb16_x4_ssse3, 0, hsum_ga16_x4_ssse3, 0, hsum_rgba16_x4_ssse3 },
+    };
+    int cpu = sped_cpu();
+    if ((cpu & SPED_CPU_SSSE3) && ctype != 3)
+        *hsum = scale == 2 ? s2[bpc - 1][ctype] : s4[bpc - 1][ctype];
+    if ((cpu & SPED_CPU_AVX2) && (cpu & SPED_CPU_SSSE3) && bpc == 1 && ctype == 2)
+        *hsum = scale == 2 ? hsum_rgb8_x2_avx2 : hsum_rgb8_x4_avx2;
+    if ((cpu & SPED_CPU_AVX2) && (cpu & SPED_CPU_SSSE3) && bpc == 1 && ctype == 6)
+        *hsum = scale == 2 ? hsum_rgba8_x2_avx2 : hsum_rgba8_x4_avx2;
+#endif
+    return gray ? 1 : 4;
+}
+
+/* ---- Fused row pipelines ----
+ *
+ * A row kernel takes one complete, still-filtered scanline (d->src)
+ * through unfilter into d->cur, conversion or accumulation and output.
+ * It works in strips of SPED_STRIP pixels so each strip is converted
+ * right after it has been reconstructed, while it is still in L1. One
+ * kernel is generated per (format, scale) and picked once per image by
+ * row_select(), leaving the per-row path free of format and scale
+ * branches. */
+
+#ifndef SPED_STRIP
+#define SPED_STRIP 256   /* pixels per strip; must be a multiple of 8 */
+#endif
+
+typedef struct sped_dec sped_dec;
+typedef void (*sped_row_fn)(sped_dec *d);
+typedef unsigned (*sped_blend_fn)(uint16_t *out, uint8_t *a8, const uint8_t *src,
+                                  uint32_t n, const sped_dec *d, int split);
+
+/* Per-image decode state shared by the row kernels */
+struct sped_dec {
+    uint8_t *cur, *prev;            /* current / previous scanline */
+    const uint8_t *src;             /* filtered bytes of the current scanline */
+    uint16_t *out;                  /* output row, or its slot in the band */
+    uint16_t *acc;                  /* box sums: acc_nc lanes per output pixel */
+    sped_hsum_fn hsum;              /* box kernels */
+    sped_emit_fn emit;
+    int acc_nc;
+    uint32_t *wacc[2];              /* area filter sums, Q23: this output row, the next */
+    const uint32_t *ax, *an;        /* area filter plan: first source pixel, count */
+    const uint16_t *aw;             /* and their Q15 weights, column after column */
+    uint8_t *pick;                  /* nearest, Adam7: the picked pixels of a row */
+    uint16_t *canvas, *ctmp;        /* Adam7: output window so far, converted picks */
+    int pass;                       /* Adam7 pass being decoded, 0..6; -1 = not interlaced */
+    uint32_t pw, ph, py;            /* its size in pixels, and its current row */
+    uint32_t y0, out_h;             /* output rows: first (ROI), count */
+    int prog;                       /* SPED_PROGRESSIVE: fill the blocks passes stand for */
+    unsigned use;                   /* passes to convert, bit per pass */
+    int bits;                       /* bits per pixel: below 8, pixels are packed */
+    uint8_t *px;                    /* packed: the row unpacked, a byte per pixel */
+    uint8_t (*unpack8)[8];          /* packed: each byte's pixels as bytes (gray */
+    uint16_t (*unpack565)[8];       /*   scaled to 8 bits) or as RGB565; one is set */
+    sped_row_fn row_px;             /* packed: 8-bit kernel for the unpacked row */
+    uint32_t a_oh, a_sh;            /* output rows, and the source rows they cover */
+    int alpha;                      /* blend: on, and the image has alpha or tRNS */
+    sped_blend_fn blend;            /* converter that blends, for this format */
+    uint8_t *plane;                 /* SPED_ALPHA_PLANE or spans: alpha of the output */
+    const uint16_t *obase;          /*   buffers, pixel for pixel from obase on */
+    int split;                      /* colors unblended, alpha only in the plane */
+    unsigned seen;                  /* alphas met: 1 = some 0, 2 = some in between */
+    sped_dst_cb dst;                /* rows to blend onto, else bg when bg_fill */
+    void *dst_user;                 /*   is set, else out as it is (a surface) */
+    int bg_fill;
+    uint16_t bg;
+    uint8_t key[6];                 /* tRNS color key, as the pixel's bytes */
+    uint8_t *atmp, *acanvas;        /* Adam7 with alpha: alpha of ctmp, of canvas */
+    uint8_t pal[256][3];            /* PLTE */
+    uint8_t pal_a[256];             /* tRNS alpha per palette entry or gray level */
+    uint16_t lut[257];              /* RGB565 per gray level / palette index */
+    sped_unfilter_fn unf[5];        /* indexed by filter type */
+    sped_convert_fn conv;
+    sped_row_fn row_fn;
+    unsigned fmt;                   /* format the kernels above are for, 0 = none */
+    int lut_gray;                   /* lut holds the gray ramp */
+    uint32_t w;                     /* columns to unfilter: none right of the ROI is needed */
+    uint32_t x0, out_w;             /* output columns: first (ROI), count */
+    int bpp;
+    uint8_t filter;                 /* filter type of the current scanline */
+    int row, out_row;
+    sped_row_cb cb;
+    void *user;
+};
+
+/* ---- Alpha ----
+ * Blending happens in the output row: it first gets the pixels the row
+ * goes onto (row_under), then each pixel replaces what is there if it is
+ * opaque, leaves it if it is transparent, and is mixed into it in 8-bit
+ * fixed point otherwise. Alpha is the alpha sample's high byte, the tRNS
+ * entry of a palette index or gray level, or 0 for the tRNS color key.
+ * With an alpha plane, alpha also goes beside the pixels; split, colors
+ * go out as they are and are not blended at all. Converters report the
+ * alphas they met, as bits for d->seen. */
+
+#define SPED_A_KEY  -1   /* alpha: 0 where the pixel's bytes are key */
+#define SPED_A_IDX  -2   /* alpha: pal_a of the first byte */
+#define SPED_A_NONE -3   /* opaque */
+
+/* Alpha of the pixel at p; A = offset of its alpha sample, or one of the
+ * above */
+SPED_TEMPLATE uint32_t alpha_of(const sped_dec *d, const uint8_t *p,
+                                const int S, const int A)
+{
+    if (A >= 0) return p[A];
+    if (A == SPED_A_IDX) return d->pal_a[*p];
+    if (A == SPED_A_KEY) return memcmp(p, d->key, (size_t)S) ? 255 : 0;
+    return 255;
+}
+
+/* Color r, g, b, premultiplied by its alpha a (each at most 255 * a),
+ * over RGB565 pixel u */
+static inline uint16_t over565(uint32_t r, uint32_t g, uint32_t b, uint32_t a,
+                               uint16_t u)
+{
+    uint32_t ur = (u >> 8 & 0xF8) | u >> 13;
+    uint32_t ug = (u >> 3 & 0xFC) | (u >> 9 & 3);
+    uint32_t ub = (u << 3 & 0xF8) | (u >> 2 & 7);
+    r += ur * (255 - a) + 128;   /* /255, rounded: exact up to 255 * 255 */
+    g += ug * (255 - a) + 128;
+    b += ub * (255 - a) + 128;
+    return rgb565((uint8_t)((r + (r >> 8)) >> 8), (uint8_t)((g + (g >> 8)) >> 8),
+                  (uint8_t)((b + (b >> 8)) >> 8));
+}
+
+/* n pixels blended onto out, with REC their alpha also into a8, or with
+ * SPLIT their colors into out and their alpha into a8. R/G/B all 0 =
+ * gray; gray and palette colors come from the LUT when opaque. */
+SPED_TEMPLATE unsigned alpha_px(uint16_t *out, uint8_t *a8, const uint8_t *src,
+                                uint32_t n, const sped_dec *d, const int S,
+                                const int R, const int G, const int B, const int A,
+                                const int PAL, const int REC, const int SPLIT)
+{
+    const int LUT = PAL || (R == G && G == B);
+    unsigned seen = 0;
+    for (uint32_t x = 0; x < n; x++, src += S) {
+        uint32_t a = alpha_of(d, src, S, A);
+        if (REC) a8[x] = (uint8_t)a;
+        if (a == 255 || SPLIT) {
+            out[x] = LUT ? d->lut[*src] : rgb565(src[R], src[G], src[B]);
+            if (SPLIT && a != 255) seen |= a ? 2 : 1;
+        } else if (a) {
+            const uint8_t *c = PAL ? d->pal[*src] : src;
+            out[x] = PAL ? over565(c[0] * a, c[1] * a, c[2] * a, a, out[x])
+                         : over565(c[R] * a, c[G] * a, c[B] * a, a, out[x]);
+            seen |= 2;
+        } else {
+            seen |= 1;
+        }
+    }
+    return seen;
+}
+
+#define SPED_ALPHA(NAME, S, R, G, B, A, PAL)                                 \
+static unsigned alpha_##NAME(uint16_t *out, uint8_t *a8, const uint8_t *src, \
+                             uint32_t n, const sped_dec *d, int split)       \
+{                                                                            \
+    if (split) return alpha_px(out, a8, src, n, d, S, R, G, B, A, PAL, 1, 1); \
+    if (a8) return alpha_px(out, a8, src, n, d, S, R, G, B, A, PAL, 1, 0);   \
+    return alpha_px(out, a8, src, n, d, S, R, G, B, A, PAL, 0, 0);           \
+}
+
+SPED_ALPHA(gray8,  1, 0, 0, 0, SPED_A_IDX, 0)
+SPED_ALPHA(ga8,    2, 0, 0, 0, 1,          0)
+SPED_ALPHA(rgb8,   3, 0, 1, 2, SPED_A_KEY, 0)
+SPED_ALPHA(rgba8,  4, 0, 1, 2, 3,          0)
+SPED_ALPHA(gray16, 2, 0, 0, 0, SPED_A_KEY, 0)
+SPED_ALPHA(ga16,   4, 0, 0, 0, 2,          0)
+SPED_ALPHA(rgb16,  6, 0, 2, 4, SPED_A_KEY, 0)
+SPED_ALPHA(rgba16, 8, 0, 2, 4, 6,          0)
+SPED_ALPHA(pal8,   1, 0, 0, 0, SPED_A_IDX, 1)
+
+static sped_blend_fn blend_select(uint8_t ctype, int bpc)
+{
+    int wide = (bpc == 2);
+    switch (ctype) {
+        case 0:  return wide ? alpha_gray16 : alpha_gray8;
+        case 2:  return wide ? alpha_rgb16  : alpha_rgb8;
+        case 3:  return alpha_pal8;
+        case 4:  return wide ? alpha_ga16   : alpha_ga8;
+        default: return wide ? alpha_rgba16 : alpha_rgba8;
+    }
+}
+
+/* Converted pixels c with alpha a onto out */
+static void alpha_over(uint16_t *out, const uint16_t *c, const uint8_t *a,
+                       uint32_t n)
+{
+    for (uint32_t x = 0; x < n; x++) {
+        uint32_t v = a[x], u = c[x];
+        if (v == 255) {
+            out[x] = (uint16_t)u;
+        } else if (v) {
+            uint32_t r = (u >> 8 & 0xF8) | u >> 13;
+            uint32_t g = (u >> 3 & 0xFC) | (u >> 9 & 3);
+            uint32_t b = (u << 3 & 0xF8) | (u >> 2 & 7);
+            out[x] = over565(r * v, g * v, b * v, v, out[x]);
+        }
+    }
+}
+
+/* Convert n pixels with alpha into out, a part of the output buffers:
+ * blended onto it or split, with their alpha in the plane if there is one */
+static inline void alpha_conv(sped_dec *d, uint16_t *out, const uint8_t *src,
+                              uint32_t n)
+{
+    d->seen |= d->blend(out, d->plane ? d->plane + (out - d->obase) : NULL, src, n, d,
+                        d->split);
+}
+
+/* Fill the output row with the pixels output row y goes onto (none when
+ * split) */
+static void row_under(sped_dec *d, int y)
+{
+    if (d->dst)
+        d->dst(y, (int)d->out_w, d->out, d->dst_user);
+    else if (d->bg_fill)
+        for (uint32_t x = 0; x < d->out_w; x++) d->out[x] = d->bg;
+}
+
+/* Full size: unfilter and convert strip by strip, then emit. Columns
+ * left of the ROI are unfiltered only. */
+static void row_full(sped_dec *d)
+{
+    sped_unfilter_fn unf = d->unf[d->filter];
+    int bpp = d->bpp;
+    if (d->alpha) row_under(d, d->row);
+    for (uint32_t x = 0; x < d->w; x += SPED_STRIP) {
+        uint32_t n = d->w - x < SPED_STRIP ? d->w - x : SPED_STRIP;
+        uint32_t c = x < d->x0 ? d->x0 : x;
+        unf(d->cur, d->src, d->prev, (int)x * bpp, (int)(x + n) * bpp);
+        if (c < x + n && d->alpha)
+            alpha_conv(d, d->out + (c - d->x0), d->cur + c * bpp, x + n - c);
+        else if (c < x + n)
+            d->conv(d->out + (c - d->x0), d->cur + c * bpp, x + n - c, d->lut);
+    }
+    d->cb(d->row, (int)d->out_w, d->out, d->user);
+}
+
+/* Downscaled by SCALE x SCALE boxes: strip by strip the horizontal box
+ * kernel adds the new pixels into acc, and every SCALE rows the emit
+ * kernel writes the averages. */
+SPED_TEMPLATE void row_scaled(sped_dec *d, const int SCALE)
+{
+    sped_unfilter_fn unf = d->unf[d->filter];
+    uint32_t S = (uint32_t)d->bpp;
+    uint32_t x0 = d->x0;
+    uint32_t limit = (x0 + d->out_w) * SCALE;   /* trailing partial block is dropped */
+
+    for (uint32_t x = 0; x < d->w; x += SPED_STRIP) {
+        uint32_t xe = d->w - x < SPED_STRIP ? d->w : x + SPED_STRIP;
+        uint32_t ox = x / SCALE < x0 ? x0 : x / SCALE;
+        unf(d->cur, d->src, d->prev, (int)x * (int)S, (int)(xe * S));
+        if (xe > limit) xe = limit;
+        if (ox < xe / SCALE)
+            d->hsum(d->acc + (ox - x0) * (uint32_t)d->acc_nc, d->cur + ox * SCALE * S,
+                    xe / SCALE - ox, (const uint8_t (*)[3])d->pal);
+    }
+
+    /* Emit averaged row every SCALE input rows */
+    if ((d->row % SCALE) == SCALE - 1) {
+        d->emit(d->out, d->acc, d->out_w, SCALE == 2 ? 2 : 4);
+        d->cb(d->out_row, (int)d->out_w, d->out, d->user);
+        d->out_row++;
+    }
+}
+
+static void row_x2(sped_dec *d) { row_scaled(d, 2); }
+static void row_x4(sped_dec *d) { row_scaled(d, 4); }
+
+/* Any other size: area filter. Each output pixel is the mean of the
+ * source pixels under it, weighted by how much of each it covers. Weights
+ * are Q15 and sum to exactly 1 across (the plan in ax/an/aw) and down
+ * (from the row's span), so the 32-bit sums can't overflow and emitting
+ * needs no divide. A row that straddles two output rows adds its share
+ * of the second to wacc[1]. With alpha (A as for alpha_of) each pixel's
+ * color is weighted by its alpha too, and a fourth lane adds up alpha. */
+SPED_TEMPLATE void row_area(sped_dec *d, const int S, const int R,
+                            const int G, const int B, const int PAL, const int A)
+{
+    const int LN = A == SPED_A_NONE ? 3 : 4;
+    sped_unfilter_fn unf = d->unf[d->filter];
+    const uint8_t *cur = d->cur;
+    const uint32_t *ax = d->ax, *an = d->an;
+    const uint16_t *aw = d->aw;
+
+    /* This row spans [v0, v1) in units of 1/sh output rows */
+    uint64_t sh = d->a_sh;
+    uint64_t v0 = (uint64_t)d->row * d->a_oh, v1 = v0 + d->a_oh;
+    uint64_t k = v0 / sh, ke = (k + 1) * sh;
+    uint32_t wy0 = (uint32_t)((((v1 < ke ? v1 : ke) - k * sh) << 15) / sh -
+                              ((v0 - k * sh) << 15) / sh);
+    uint32_t wy1 = v1 > ke ? (uint32_t)(((v1 - ke) << 15) / sh) : 0;
+    if (k < (uint64_t)d->out_row) {   /* row k is above the ROI */
+        wy0 = wy1;
+        wy1 = 0;
+    }
+
+    uint32_t i = 0;
+    unsigned seen = 0;
+    for (uint32_t x = 0; x < d->w; x += SPED_STRIP) {
+        uint32_t xe = d->w - x < SPED_STRIP ? d->w : x + SPED_STRIP;
+        unf(d->cur, d->src, d->prev, (int)x * S, (int)xe * S);
+        /* columns whose pixels are all unfiltered now */
+        for (; i < d->out_w && ax[i] + an[i] <= xe; i++) {
+            const uint8_t *p = cur + ax[i] * S;
+            uint32_t r = 0, g = 0, b = 0, a = 0;
+            for (uint32_t n = an[i]; n; n--, p += S, aw++) {
+                const uint8_t *c = PAL ? d->pal[*p] : p;
+                uint32_t w = *aw;
+                if (A != SPED_A_NONE) {
+                    uint32_t pa = alpha_of(d, p, S, A);
+                    if (pa != 255) seen |= pa ? 2 : 1;
+                    if (pa == 0) continue;
+                    a += w * pa;
+                    w *= pa;
+                }
+                if (PAL) {
+                    r += w * c[0]; g += w * c[1]; b += w * c[2];
+                } else {
+                    r += w * c[R]; g += w * c[G]; b += w * c[B];
+                }
+            }
+            if (A == SPED_A_NONE) {
+                r >>= 7; g >>= 7; b >>= 7;   /* Q8 */
+            } else {
+                r >>= 15; g >>= 15; b >>= 15;   /* times alpha, at most 255 * 255 */
+                a >>= 7;
+            }
+            uint32_t *acc = d->wacc[0] + i * LN;
+            acc[0] += r * wy0; acc[1] += g * wy0; acc[2] += b * wy0;
+            if (LN == 4) acc[3] += a * wy0;
+            if (wy1) {
+                acc = d->wacc[1] + i * LN;
+                acc[0] += r * wy1; acc[1] += g * wy1; acc[2] += b * wy1;
+                if (LN == 4) acc[3] += a * wy1;
+            }
+        }
+    }
+
+    d->seen |= seen;
+
+    /* Output row k is complete */
+    if (v1 >= ke && k == (uint64_t)d->out_row) {
+        uint32_t *acc = d->wacc[0];
+        if (A != SPED_A_NONE) row_under(d, d->out_row);
+        for (uint32_t ox = 0; ox < d->out_w; ox++, acc += LN) {
+            if (A == SPED_A_NONE) {
+                d->out[ox] = rgb565((uint8_t)((acc[0] + (1u << 22)) >> 23),
+                                    (uint8_t)((acc[1] + (1u << 22)) >> 23),
+                                    (uint8_t)((acc[2] + (1u << 22)) >> 23));
+                continue;
+            }
+            uint32_t a = (acc[3] + (1u << 22)) >> 23, m = a * 255;
+            uint32_t r = (acc[0] + (1u << 14)) >> 15, g = (acc[1] + (1u << 14)) >> 15,
+                     b = (acc[2] + (1u << 14)) >> 15;
+            r = r < m ? r : m;
+            g = g < m ? g : m;
+            b = b < m ? b : m;
+            if (d->plane) d->plane[d->out + ox - d->obase] = (uint8_t)a;
+            if (d->split) {   /* the mean color of what is not transparent */
+                d->out[ox] = a ? rgb565((uint8_t)((r + a / 2) / a), (uint8_t)((g + a / 2) / a),
+                                        (uint8_t)((b + a / 2) / a)) : 0;
+            } else if (a) {
+                d->out[ox] = over565(r, g, b, a, d->out[ox]);
+            }
+        }
+        d->cb(d->out_row, (int)d->out_w, d->out, d->user);
+        d->out_row++;
+        acc = d->wacc[0];
+        memset(acc, 0, d->out_w * LN * sizeof(uint32_t));
+        d->wacc[0] = d->wacc[1];
+        d->wacc[1] = acc;
+    }
+}
+
+#define SPED_ROW_AREA(NAME, S, R, G, B, PAL, A)                              \
+static void row_##NAME##_area(sped_dec *d)                                   \
+{                                                                            \
+    if (d->alpha) row_area(d, S, R, G, B, PAL, A);                           \
+    else row_area(d, S, R, G, B, PAL, SPED_A_NONE);                          \
+}
+
+SPED_ROW_AREA(gray8,  1, 0, 0, 0, 0, SPED_A_IDX)
+SPED_ROW_AREA(ga8,    2, 0, 0, 0, 0, 1)
+SPED_ROW_AREA(rgb8,   3, 0, 1, 2, 0, SPED_A_KEY)
+SPED_ROW_AREA(rgba8,  4, 0, 1, 2, 0, 3)
+SPED_ROW_AREA(gray16, 2, 0, 0, 0, 0, SPED_A_KEY)
+SPED_ROW_AREA(ga16,   4, 0, 0, 0, 0, 2)
+SPED_ROW_AREA(rgb16,  6, 0, 2, 4, 0, SPED_A_KEY)
+SPED_ROW_AREA(rgba16, 8, 0, 2, 4, 0, 6)
+SPED_ROW_AREA(pal8,   1, 0, 0, 0, 1, SPED_A_IDX)
+
+/* Nearest (SPED_NEAREST): every row is unfiltered, as the next depends
+ * on it, but only on the row nearest each output row's centre are the
+ * pixels nearest each column's centre (plan in ax) gathered into pick
+ * and converted in one go. Works for any format. */
+static void row_nearest(sped_dec *d)
+{
+    uint32_t bpp = (uint32_t)d->bpp;
+    uint64_t pick = ((uint64_t)d->out_row * 2 + 1) * d->a_sh / ((uint64_t)d->a_oh * 2);
+    d->unf[d->filter](d->cur, d->src, d->prev, 0, (int)(d->w * bpp));
+    if ((uint64_t)d->row != pick) return;
+
+    uint8_t *g = d->pick;
+    const uint8_t *cur = d->cur;
+    for (uint32_t i = 0; i < d->out_w; i++, g += bpp)
+        memcpy(g, cur + d->ax[i] * bpp, bpp);
+    if (d->alpha) {
+        row_under(d, d->out_row);
+        alpha_conv(d, d->out, d->pick, d->out_w);
+    } else {
+        d->conv(d->out, d->pick, d->out_w, d->lut);
+    }
+    d->cb(d->out_row, (int)d->out_w, d->out, d->user);
+    d->out_row++;
+}
+
+/* Adam7 passes: first column and row, column and row step, then the
+ * block each pixel stands for until later passes fill it in */
+static const uint8_t adam7[7][6] = {
+    { 0, 0, 8, 8, 8, 8 }, { 4, 0, 8, 8, 4, 8 }, { 0, 4, 4, 8, 4, 4 },
+    { 2, 0, 4, 4, 2, 4 }, { 0, 2, 2, 4, 2, 2 }, { 1, 0, 2, 2, 1, 2 },
+    { 0, 1, 1, 2, 1, 1 },
+};
+
+/* Pixels in one row (n = width) or column (n = height) of pass p */
+static uint32_t adam7_len(uint32_t n, int p, int axis)
+{
+    uint32_t s = adam7[p][axis], d = adam7[p][2 + axis];
+    return n > s ? (n - s + d - 1) / d : 0;
+}
+
+/* log2 of each pass's column step */
+static const uint8_t adam7_xsh[7] = { 3, 3, 2, 2, 1, 1, 0 };
+
+/* The pixel of a pass row whose block [s + k*d, s + k*d + b), d = 1 << sh,
+ * holds source column x: its index k, or -1 */
+static inline int64_t adam7_hit(uint32_t x, uint32_t s, int sh, uint32_t b)
+{
+    if (x < s || ((x - s) & ((1u << sh) - 1)) >= b) return -1;
+    return (x - s) >> sh;
+}
+
+/* Interlaced: each output pixel shows the source pixel at its top left
+ * corner (plan in ax). Its pass fills it into the canvas, the window of
+ * the output image, which is emitted once the last pass holding such a
+ * pixel is done. With prog set, every pixel also fills the part of its
+ * block that later passes refine, so the canvas is a whole image after
+ * each pass. */
+static void row_adam7(sped_dec *d)
+{
+    const uint8_t *a = adam7[d->pass];
+    uint32_t bpp = (uint32_t)d->bpp;
+    uint32_t bw = d->prog ? a[4] : 1, bh = d->prog ? a[5] : 1;
+    int sh = adam7_xsh[d->pass];
+    uint64_t y = a[1] + (uint64_t)d->py * a[3];
+    d->unf[d->filter](d->cur, d->src, d->prev, 0, (int)(d->pw * bpp));
+    if (!(d->use >> d->pass & 1)) return;
+
+    /* output rows whose top left pixel lies in [y, y + bh) */
+    uint64_t j0 = (y * d->a_oh + d->a_sh - 1) / d->a_sh;
+    uint64_t j1 = ((y + bh) * d->a_oh + d->a_sh - 1) / d->a_sh;
+    if (j0 < d->y0) j0 = d->y0;
+    if (j1 > (uint64_t)d->y0 + d->out_h) j1 = (uint64_t)d->y0 + d->out_h;
+    if (j0 >= j1) return;
+
+    /* gather the pixels the output columns need, convert them together */
+    uint32_t n = 0;
+    int64_t last = -1, k;
+    for (uint32_t i = 0; i < d->out_w; i++) {
+        if ((k = adam7_hit(d->ax[i], a[0], sh, bw)) < 0 || k == last) continue;
+        memcpy(d->pick + n++ * bpp, d->cur + (size_t)k * bpp, bpp);
+        last = k;
+    }
+    if (n == 0) return;
+    if (d->alpha) d->seen |= d->blend(d->ctmp, d->atmp, d->pick, n, d, 1);   /* blended as emitted */
+    else d->conv(d->ctmp, d->pick, n, d->lut);
+
+    for (uint64_t j = j0; j < j1; j++) {
+        uint16_t *row = d->canvas + (size_t)(j - d->y0) * d->out_w;
+        uint8_t *arow = d->alpha ? d->acanvas + (size_t)(j - d->y0) * d->out_w : NULL;
+        size_t m = 0;   /* picks so far */
+        last = -1;
+        for (uint32_t i = 0; i < d->out_w; i++) {
+            if ((k = adam7_hit(d->ax[i], a[0], sh, bw)) < 0) continue;
+            if (k != last) m++;
+            row[i] = d->ctmp[m - 1];
+            if (arow) arow[i] = d->atmp[m - 1];
+            last = k;
+        }
+    }
+}
+
+/* ---- Packed pixels (1, 2 and 4-bit gray and palette) ----
+ * Unfiltered a byte at a time (filters see them as 1 byte per pixel), then
+ * unpacked through a per-image table holding each byte value's 8, 4 or 2
+ * pixels: straight to RGB565 at full size, else to one byte per pixel for
+ * the 8-bit kernels. */
+
+/* n pixels from pixel x of a packed row, through the byte table t of
+ * S-byte entries */
+SPED_TEMPLATE void unpack_px(void *dst, const uint8_t *row, uint32_t x,
+                             uint32_t n, int bits, const void *t, const size_t S)
+{
+    uint32_t ppb = 8u / (uint32_t)bits, k = x % ppb;
+    const uint8_t *p = row + x / ppb;
+    uint8_t *o = dst;
+    while (n) {
+        uint32_t m = ppb - k < n ? ppb - k : n;
+        memcpy(o, (const uint8_t *)t + (*p++ * 8u + k) * S, m * S);
+        o += m * S;
+        n -= m;
+        k = 0;
+    }
+}
+
+/* Full size: unfilter and unpack to RGB565 strip by strip; strips start
+ * on whole bytes */
+static void row_packed_full(sped_dec *d)
+{
+    sped_unfilter_fn unf = d->unf[d->filter];
+    uint32_t bits = (uint32_t)d->bits;
+    for (uint32_t x = 0; x < d->w; x += SPED_STRIP) {
+        uint32_t n = d->w - x < SPED_STRIP ? d->w - x : SPED_STRIP;
+        uint32_t c = x < d->x0 ? d->x0 : x;
+        unf(d->cur, d->src, d->prev, (int)(x * bits / 8), (int)(((x + n) * bits + 7) / 8));
+        if (c < x + n)
+            unpack_px(d->out + (c - d->x0), d->cur, c, x + n - c, d->bits,
+                      d->unpack565, sizeof(uint16_t));
+    }
+    d->cb(d->row, (int)d->out_w, d->out, d->user);
+}
+
+/* Downscaled or interlaced: unfilter, unpack the row into px and hand
+ * that to the 8-bit kernel as a row that needs no unfiltering */
+static void row_packed(sped_dec *d)
+{
+    uint32_t n = d->pass >= 0 ? d->pw : d->w;
+    uint8_t *cur = d->cur;
+    d->unf[d->filter](cur, d->src, d->prev, 0, (int)((n * (uint32_t)d->bits + 7) / 8));
+    unpack_px(d->px, cur, 0, n, d->bits, d->unpack8, 1);
+    d->cur = d->px;
+    d->src = d->px;
+    d->filter = 0;   /* unfilter_none in place: nothing to do */
+    d->row_px(d);
+    d->cur = cur;
+}
+
+/* Fill the unpack table: gray levels scaled to 8 bits, palette indices
+ * as they are, or either through the LUT to RGB565 */
+static void unpack_build(sped_dec *d, uint8_t ctype)
+{
+    int bits = d->bits, ppb = 8 / bits, m = (1 << bits) - 1;
+    for (int b = 0; b < 256; b++) {
+        for (int k = 0; k < ppb; k++) {
+            int v = (b >> (8 - bits * (k + 1))) & m;
+            if (ctype == 0) v = v * 255 / m;
+            if (d->unpack8) d->unpack8[b][k] = (uint8_t)v;
+            else d->unpack565[b][k] = d->lut[v];
+        }
+    }
+}
+
+/* Pick the row kernel for this format and box scale, 0 = area filter */
+static sped_row_fn row_select(uint8_t ctype, int bpc, int scale)
+{
+    static const sped_row_fn area[2][7] = {
+        { row_gray8_area,  0, row_rgb8_area,  row_pal8_area, row_ga8_area,  0, row_rgba8_area  },
+        { row_gray16_area, 0, row_rgb16_area, 0,             row_ga16_area, 0, row_rgba16_area },
+    };
+    if (scale == 1) return row_full;
+    if (scale == 2) return row_x2;
+    if (scale == 4) return row_x4;
+    return area[bpc - 1][ctype];
+}
+
+/* ---- Built-in inflater (SPED_INFLATE_BUILTIN) ----
+ *
+ * Streaming zlib/DEFLATE decoder with tinfl's memory model: output goes
+ * into the caller's 32 KB ring window and input may arrive in any number
+ * of pieces. Tuned for throughput:
+ *  - 64-bit bit buffer, refilled 8 bytes at a time without branches
+ *  - 10-bit literal/length table whose entries can hold two literals,
+ *    so runs of short literal codes decode two symbols per lookup
+ *  - match copies 8 bytes at a time, run-length fill for distance 1
+ * A slow path handles headers, window wrap and the last few bytes of
+ * each input piece; it can stop and resume at any symbol boundary.
+ * The state holds no pointers, so it can be copied. The Adler-32
+ * trailer is skipped, like the chunk CRCs. */
+
+#ifdef SPED_INFLATE_BUILTIN
+
+#define INF_WIN   32768u
+#define INF_LBITS 10                 /* literal/length fast table bits */
+#define INF_DBITS 8                  /* distance fast table bits */
+
+/* Literal/length table entry: total bits in 0-4, kind in 5-7, bits of
+ * the first literal of a pair in 8-11, symbol or literal(s) from 16 */
+enum { INF_SLOW, INF_LIT, INF_LIT2, INF_SYM };
+#define INF_E_LEN(e)  ((unsigned)(e) & 31)
+#define INF_E_KIND(e) (((unsigned)(e) >> 5) & 7)
+#define INF_E_LEN1(e) (((unsigned)(e) >> 8) & 15)
+
+enum {
+    INF_M_ZHDR, INF_M_BLOCK, INF_M_STORED_HDR, INF_M_STORED, INF_M_DYN_HDR,
+    INF_M_DYN_CL, INF_M_DYN_LENS, INF_M_CODES, INF_M_COPY, INF_M_TRAILER,
+    INF_M_DONE, INF_M_FAIL
+};
+
+typedef struct {
+    uint64_t bits;                   /* bit buffer, next bit in bit 0 */
+    uint32_t nbits;
+    uint32_t mode;
+    uint32_t final;                  /* current block is the last one */
+    uint32_t len, dist;              /* pending match / stored bytes left */
+    uint32_t have;                   /* valid history in the window */
+    uint32_t hlit, hdist, hclen, k;  /* dynamic header progress */
+    uint32_t fixed;                  /* tables hold the fixed codes */
+    uint8_t lens[288 + 32];
+    uint16_t lcount[16], lsym[288];  /* canonical codes, for the slow path */
+    uint16_t dcount[16], dsym[32];
+    uint32_t lfast[1 << INF_LBITS];
+    uint16_t dfast[1 << INF_DBITS];  /* bits | symbol << 8; 0 = slow */
+} sped_inflater;
+
+static const uint16_t inf_lbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t inf_lext[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t inf_dbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+    513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t inf_dext[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t inf_clorder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static void inf_init(sped_inflater *z)
+{
+    z->bits = 0;
+    z->nbits = 0;
+    z->mode = INF_M_ZHDR;
+    z->have = 0;
+    z->fixed = 0;
+}
+
+static inline uint64_t inf_le64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static unsigned inf_rev(unsigned code, unsigned len)
+{
+    unsigned r = 0;
+    while (len--) { r = (r << 1) | (code & 1); code >>= 1; }
+    return r;
+}
+
+/* Count codes per length and sort symbols by code. Returns -1 if the
+ * lengths over-subscribe the code space. */
+static int inf_build(uint16_t *count, uint16_t *sym, const uint8_t *lens, int n)
+{
+    uint16_t offs[16];
+    memset(count, 0, 16 * sizeof(uint16_t));
+    for (int i = 0; i < n; i++) count[lens[i]]++;
+    int left = 1;
+    for (int l = 1; l < 16; l++) {
+        left = (left << 1) - count[l];
+        if (left < 0) return -1;
+    }
+    offs[1] = 0;
+    for (int l = 1; l < 15; l++) offs[l + 1] = (uint16_t)(offs[l] + count[l]);
+    for (int i = 0; i < n; i++)
+        if (lens[i]) sym[offs[lens[i]]++] = (uint16_t)i;
+    return 0;
+}
+
+static void inf_fill_dist(uint16_t *t, const uint16_t *count, const uint16_t *sym)
+{
+    unsigned code = 0, idx = 0;
+    memset(t, 0, sizeof(uint16_t) << INF_DBITS);
+    for (unsigned len = 1; len <= INF_DBITS; len++, code <<= 1) {
+        for (unsigned j = 0; j < count[len]; j++, idx++, code++) {
+            uint16_t e = (uint16_t)(len | (unsigned)sym[idx] << 8);
+            for (unsigned r = inf_rev(code, len); r < (1u << INF_DBITS); r += 1u << len)
+                t[r] = e;
+        }
+    }
+}
+
+static void inf_fill_lit(sped_inflater *z)
+{
+    uint32_t *t = z->lfast;
+    unsigned code = 0, idx = 0;
+    memset(t, 0, sizeof(z->lfast));
+    for (unsigned len = 1; len <= INF_LBITS; len++, code <<= 1) {
+        for (unsigned j = 0; j < z->lcount[len]; j++, idx++, code++) {
+            unsigned sym = z->lsym[idx];
+            uint32_t e = len | (uint32_t)(sym < 256 ? INF_LIT : INF_SYM) << 5 |
+                         (uint32_t)sym << 16;
+            for (unsigned r = inf_rev(code, len); r < (1u << INF_LBITS); r += 1u << len)
+                t[r] = e;
+        }
+    }
+    /* Where a literal's code leaves room for a whole second literal code
+     * inside the table bits, store both. Walking down keeps t[i >> l1]
+     * a single-symbol entry when it is read. */
+    for (int i = (1 << INF_LBITS) - 1; i >= 0; i--) {
+        uint32_t e = t[i];
+        if (INF_E_KIND(e) != INF_LIT) continue;
+        unsigned l1 = INF_E_LEN(e);
+        uint32_t e2 = t[i >> l1];
+        if (INF_E_KIND(e2) != INF_LIT || l1 + INF_E_LEN(e2) > INF_LBITS) continue;
+        t[i] = (l1 + INF_E_LEN(e2)) | (uint32_t)INF_LIT2 << 5 | l1 << 8 |
+               (e >> 16) << 16 | (e2 >> 16) << 24;
+    }
+}
+
+static void inf_fixed(sped_inflater *z)
+{
+    int i = 0;
+    if (z->fixed) return;
+    for (; i < 144; i++) z->lens[i] = 8;
+    for (; i < 256; i++) z->lens[i] = 9;
+    for (; i < 280; i++) z->lens[i] = 7;
+    for (; i < 288; i++) z->lens[i] = 8;
+    for (i = 0; i < 30; i++) z->lens[288 + i] = 5;
+    inf_build(z->lcount, z->lsym, z->lens, 288);
+    inf_build(z->dcount, z->dsym, z->lens + 288, 30);
+    inf_fill_lit(z);
+    inf_fill_dist(z->dfast, z->dcount, z->dsym);
+    z->fixed = 1;
+}
+
+/* Decode one symbol bit by bit (codes longer than the fast tables, or
+ * too few bits buffered). Returns the symbol, -1 if more than nbits
+ * bits are needed, -2 for an invalid code. */
+static int inf_slow(const uint16_t *count, const uint16_t *sym,
+                    uint64_t bits, unsigned nbits, unsigned *used)
+{
+    int code = 0, first = 0, index = 0;
+    for (unsigned len = 1; len < 16; len++) {
+        if (len > nbits) return -1;
+        code |= (int)(bits >> (len - 1)) & 1;
+        int c = count[len];
+        if (code - c < first) {
+            *used = len;
+            return sym[index + (code - first)];
+        }
+        index += c;
+        first = (first + c) << 1;
+        code <<= 1;
+    }
+    return -2;
+}
+
+static int inf_lit_sym(const sped_inflater *z, uint64_t bits, unsigned nbits,
+                       unsigned *used)
+{
+    uint32_t e = z->lfast[bits & ((1u << INF_LBITS) - 1)];
+    unsigned kind = INF_E_KIND(e);
+    unsigned len = (kind == INF_LIT2) ? INF_E_LEN1(e) : INF_E_LEN(e);
+    if (kind != INF_SLOW && len <= nbits) {
+        *used = len;
+        return (int)((e >> 16) & (kind == INF_SYM ? 0x1FF : 0xFF));
+    }
+    return inf_slow(z->lcount, z->lsym, bits, nbits, used);
+}
+
+static int inf_dist_sym(const sped_inflater *z, uint64_t bits, unsigned nbits,
+                        unsigned *used)
+{
+    unsigned e = z->dfast[bits & ((1u << INF_DBITS) - 1)];
+    if ((e & 31) && (e & 31) <= nbits) {
+        *used = e & 31;
+        return (int)(e >> 8);
+    }
+    return inf_slow(z->dcount, z->dsym, bits, nbits, used);
+}
+
+/* Copy a match of len bytes from dist back in the ring window */
+static inline void inf_copy(uint8_t *win, uint8_t *op, unsigned dist, unsigned len)
+{
+    size_t pos = (size_t)(op - win);
+    if (dist <= pos) {
+        const uint8_t *src = op - dist;
+        if (dist >= 8) {
+            /* each 8-byte step only reads bytes already written */
+            for (; len >= 8; len -= 8, op += 8, src += 8) memcpy(op, src, 8);
+            while (len--) *op++ = *src++;
+        } else if (dist == 1) {
+            memset(op, *src, len);
+        } else {
+            while (len--) *op++ = *src++;
+        }
+    } else {
+        size_t s = pos + INF_WIN - dist;   /* source starts in the window tail */
+        while (len--) {
+            *op++ = win[s];
+            s = (s + 1) & (INF_WIN - 1);
+        }
+    }
+}
+
+/* Inflate from in[0..*in_len) into win[ofs..ofs + *out_len), win being the
+ * 32 KB ring. more = input continues after this piece. On return the
+ * lengths hold bytes consumed and produced. Status as tinfl's. */
+static int inf_run(sped_inflater *z, const uint8_t *in, size_t *in_len,
+                   uint8_t *win, size_t ofs, size_t *out_len, int more)
+{
+    const uint8_t *ip = in, *ie = in + *in_len;
+    uint8_t *o0 = win + ofs, *op = o0, *oe = o0 + *out_len;
+    uint64_t bits = z->bits;
+    unsigned nbits = z->nbits;
+    unsigned used, n;
+    int sym, st;
+
+/* Bits above nbits may hold look-ahead copies of the next input bytes;
+ * OR-ing the same bytes back in at the same position is harmless. */
+#define INF_PULL()   while (nbits <= 55 && ip < ie) { bits |= (uint64_t)*ip++ << nbits; nbits += 8; }
+#define INF_NEED(k)  do { if (nbits < (k)) { INF_PULL(); if (nbits < (k)) goto need_input; } } while (0)
+#define INF_DROP(k)  do { bits >>= (k); nbits -= (k); } while (0)
+
+    for (;;) {
+        switch (z->mode) {
+        case INF_M_ZHDR: {
+            INF_NEED(16);
+            unsigned cmf = (unsigned)bits & 0xFF, flg = (unsigned)(bits >> 8) & 0xFF;
+            if ((cmf & 15) != 8 || (cmf >> 4) > 7 || (cmf * 256 + flg) % 31 || (flg & 0x20))
+                goto fail;
+            INF_DROP(16);
+            z->mode = INF_M_BLOCK;
+            break;
+        }
+        case INF_M_BLOCK: {
+            INF_NEED(3);
+            z->final = (uint32_t)bits & 1;
+            unsigned type = (unsigned)(bits >> 1) & 3;
+            INF_DROP(3);
+            if (type == 0) {
+                z->mode = INF_M_STORED_HDR;
+            } else if (type == 1) {
+                inf_fixed(z);
+                z->mode = INF_M_CODES;
+            } else if (type == 2) {
+                z->mode = INF_M_DYN_HDR;
+            } else {
+                goto fail;
+            }
+            break;
+        }
+        case INF_M_STORED_HDR: {
+            INF_DROP(nbits & 7);
+            INF_NEED(32);
+            unsigned len = (unsigned)bits & 0xFFFF, nlen = (unsigned)(bits >> 16) & 0xFFFF;
+            if (len != (~nlen & 0xFFFF)) goto fail;
+            INF_DROP(32);
+            z->len = len;
+            z->mode = INF_M_STORED;
+            break;
+        }
+        case INF_M_STORED: {
+            for (; z->len && nbits >= 8 && op < oe; z->len--) {
+                *op++ = (uint8_t)bits;
+                INF_DROP(8);
+            }
+            if (z->len && nbits == 0) {
+                /* bypassing the bit buffer: drop its look-ahead copy */
+                size_t k = z->len;
+                if (k > (size_t)(oe - op)) k = (size_t)(oe - op);
+                if (k > (size_t)(ie - ip)) k = (size_t)(ie - ip);
+                bits = 0;
+                memcpy(op, ip, k);
+                op += k; ip += k; z->len -= (uint32_t)k;
+            }
+            if (z->len == 0) {
+                z->mode = z->final ? INF_M_TRAILER : INF_M_BLOCK;
+                break;
+            }
+            if (op == oe) goto out_full;
+            goto need_input;
+        }
+        case INF_M_DYN_HDR:
+            INF_NEED(14);
+            z->hlit = ((unsigned)bits & 31) + 257;
+            z->hdist = ((unsigned)(bits >> 5) & 31) + 1;
+            z->hclen = ((unsigned)(bits >> 10) & 15) + 4;
+            INF_DROP(14);
+            if (z->hlit > 286 || z->hdist > 30) goto fail;
+            z->fixed = 0;
+            memset(z->lens, 0, 19);
+            z->k = 0;
+            z->mode = INF_M_DYN_CL;
+            break;
+        case INF_M_DYN_CL:
+            for (; z->k < z->hclen; z->k++) {
+                INF_NEED(3);
+                z->lens[inf_clorder[z->k]] = (uint8_t)(bits & 7);
+                INF_DROP(3);
+            }
+            /* the code length code lives in the distance tables for now */
+            if (inf_build(z->dcount, z->dsym, z->lens, 19) < 0) goto fail;
+            inf_fill_dist(z->dfast, z->dcount, z->dsym);
+            z->k = 0;
+            z->mode = INF_M_DYN_LENS;
+            break;
+        case INF_M_DYN_LENS:
+            while (z->k < z->hlit + z->hdist) {
+                INF_PULL();
+                sym = inf_dist_sym(z, bits, nbits, &used);
+                if (sym == -1) goto need_input;
+                if (sym < 0) goto fail;
+                if (sym < 16) {
+                    INF_DROP(used);
+                    z->lens[z->k++] = (uint8_t)sym;
+                    continue;
+                }
+                unsigned extra = sym == 16 ? 2 : sym == 17 ? 3 : 7;
+                if (used + extra > nbits) goto need_input;
+                unsigned rep = (unsigned)(bits >> used) & ((1u << extra) - 1);
+                uint8_t v = 0;
+                if (sym == 16) {
+                    if (z->k == 0) goto fail;
+                    v = z->lens[z->k - 1];
+                    rep += 3;
+                } else {
+                    rep += sym == 17 ? 3 : 11;
+                }
+                if (z->k + rep > z->hlit + z->hdist) goto fail;
+                INF_DROP(used + extra);
+                while (rep--) z->lens[z->k++] = v;
+            }
+            if (z->lens[256] == 0) goto fail;
+            if (inf_build(z->lcount, z->lsym, z->lens, (int)z->hlit) < 0 ||
+                inf_build(z->dcount, z->dsym, z->lens + z->hlit, (int)z->hdist) < 0)
+                goto fail;
+            inf_fill_lit(z);
+            inf_fill_dist(z->dfast, z->dcount, z->dsym);
+            z->mode = INF_M_CODES;
+            break;
+        case INF_M_CODES:
+            /* Fast loop: room for any symbol's output, and 8 readable input
+             * bytes for a full refill, which covers the longest
+             * length/distance pair (48 bits). */
+            while (ie - ip >= 8 && oe - op >= 258) {
+                bits |= inf_le64(ip) << nbits;
+                ip += (63 - nbits) >> 3;
+                nbits |= 56;
+
+                uint32_t e = z->lfast[bits & ((1u << INF_LBITS) - 1)];
+                unsigned kind = INF_E_KIND(e);
+                if (kind == INF_LIT) {
+                    *op++ = (uint8_t)(e >> 16);
+                    INF_DROP(INF_E_LEN(e));
+                    continue;
+                }
+                if (kind == INF_LIT2) {
+                    op[0] = (uint8_t)(e >> 16);
+                    op[1] = (uint8_t)(e >> 24);
+                    op += 2;
+                    INF_DROP(INF_E_LEN(e));
+                    continue;
+                }
+                if (kind == INF_SYM) {
+                    sym = (int)(e >> 16);
+                    used = INF_E_LEN(e);
+                } else {
+                    sym = inf_slow(z->lcount, z->lsym, bits, nbits, &used);
+                    if (sym < 0) goto fail;
+                    if (sym < 256) {
+                        *op++ = (uint8_t)sym;
+                        INF_DROP(used);
+                        continue;
+                    }
+                }
+                INF_DROP(used);
+                if (sym == 256) {
+                    z->mode = z->final ? INF_M_TRAILER : INF_M_BLOCK;
+                    break;
+                }
+                sym -= 257;
+                if (sym >= 29) goto fail;
+                unsigned len = inf_lbase[sym] + ((unsigned)bits & ((1u << inf_lext[sym]) - 1));
+                INF_DROP(inf_lext[sym]);
+                sym = inf_dist_sym(z, bits, nbits, &used);
+                if (sym < 0 || sym >= 30) goto fail;
+                INF_DROP(used);
+                unsigned dist = inf_dbase[sym] + ((unsigned)bits & ((1u << inf_dext[sym]) - 1));
+                INF_DROP(inf_dext[sym]);
+                if (dist > z->have + (size_t)(op - o0)) goto fail;
+                inf_copy(win, op, dist, len);
+                op += len;
+            }
+            if (z->mode != INF_M_CODES) break;
+
+            /* Slow step: one symbol with whatever is buffered */
+            if (op == oe) goto out_full;
+            INF_PULL();
+            sym = inf_lit_sym(z, bits, nbits, &used);
+            if (sym == -1) goto need_input;
+            if (sym < 0) goto fail;
+            if (sym < 256) {
+                *op++ = (uint8_t)sym;
+                INF_DROP(used);
+                break;
+            }
+            if (sym == 256) {
+                INF_DROP(used);
+                z->mode = z->final ? INF_M_TRAILER : INF_M_BLOCK;
+                break;
+            }
+            sym -= 257;
+            if (sym >= 29) goto fail;
+            n = used + inf_lext[sym];
+            if (n > nbits) goto need_input;
+            z->len = inf_lbase[sym] + ((unsigned)(bits >> used) & ((1u << inf_lext[sym]) - 1));
+            sym = inf_dist_sym(z, bits >> n, nbits - n, &used);
+            if (sym == -1) goto need_input;
+            if (sym < 0 || sym >= 30) goto fail;
+            if (n + used + inf_dext[sym] > nbits) goto need_input;
+            z->dist = inf_dbase[sym] + ((unsigned)(bits >> (n + used)) & ((1u << inf_dext[sym]) - 1));
+            INF_DROP(n + used + inf_dext[sym]);
+            if (z->dist > z->have + (size_t)(op - o0)) goto fail;
+            z->mode = INF_M_COPY;
+            break;
+        case INF_M_COPY:
+            n = (unsigned)(oe - op) < z->len ? (unsigned)(oe - op) : z->len;
+            inf_copy(win, op, z->dist, n);
+            op += n;
+            z->len -= n;
+            if (z->len) goto out_full;
+            z->mode = INF_M_CODES;
+            break;
+        case INF_M_TRAILER:
+            INF_DROP(nbits & 7);
+            INF_NEED(32);   /* Adler-32, not verified */
+            INF_DROP(32);
+            z->mode = INF_M_DONE;
+            break;
+        case INF_M_DONE:
+            st = SPED_INF_DONE;
+            goto done;
+        default:
+            goto fail;
+        }
+    }
+
+out_full:
+    st = SPED_INF_HAS_OUTPUT;
+    goto done;
+need_input:
+    if (!more) goto fail;
+    st = SPED_INF_NEEDS_INPUT;
+    goto done;
+fail:
+    z->mode = INF_M_FAIL;
+    st = SPED_INF_FAILED;
+done:
+#undef INF_PULL
+#undef INF_NEED
+#undef INF_DROP
+    z->bits = bits;
+    z->nbits = nbits;
+    z->have = (uint32_t)(z->have + (size_t)(op - o0) > INF_WIN ? INF_WIN
+                                                              : z->have + (size_t)(op - o0));
+    *in_len = (size_t)(ip - in);
+    *out_len = (size_t)(op - o0);
+    return st;
+}
+
+#endif /* SPED_INFLATE_BUILTIN */
+
+/* ---- DEFLATE backends ----
+ *
+ * Streaming backends inflate into the caller's window, a ring of
+ * SPED_WINDOW bytes; feed() writes at win + ofs and never past
+ * win + ofs + *out_len. The caller always offers the rest of the ring,
+ * ofs + *out_len == SPED_WINDOW: tinfl wraps only a power-of-two
+ * buffer whose end it is given. in/in_len, out_len and more are as
+ * inf_run's.
+ * init() prepares a fresh stream, reset() rewinds one for the next
+ * image keeping any allocations, end() releases them. A backend that
+ * allocates takes its memory from a heap of `heap` bytes handed to
+ * init(), carved from the workspace. A backend whose state is plain data
+ * sets snap to its size: copied out between feeds, together with the
+ * window, it resumes the stream in any workspace (row index). */
+
+typedef struct {
+    size_t heap;
+    size_t snap;                /* state bytes to checkpoint, 0 = can't */
+    int  (*init)(void *st, void *heap);
+    int  (*feed)(void *st, const uint8_t *in, size_t *in_len,
+                 uint8_t *win, size_t ofs, size_t *out_len, int more);
+    int  (*reset)(void *st);
+    void (*end)(void *st);
+} sped_backend;
+
+#if defined(SPED_INFLATE_ZLIB) || defined(SPED_INFLATE_ZLIBNG)
+#ifdef SPED_INFLATE_ZLIBNG
+#define SPED_Z(name) zng_##name
+typedef zng_stream sped_zstream;
+#else
+#define SPED_Z(name) name
+typedef z_stream sped_zstream;
+#endif
+
+/* Heap for zlib's inflate state and 32 KB history window */
+#ifndef SPED_ZLIB_HEAP
+#define SPED_ZLIB_HEAP (64u << 10)
+#endif
+
+typedef struct {
+    sped_zstream zs;      /* first: feed() and friends cast st to it */
+    uint8_t *heap;
+    size_t used;
+} sped_zlib_state;
+
+/* Bump allocator over the heap; nothing is freed until the next init */
+static void *be_zlib_alloc(void *opaque, unsigned items, unsigned size)
+{
+    sped_zlib_state *z = opaque;
+    size_t n = ((size_t)items * size + 15) & ~(size_t)15;
+    if (n > SPED_ZLIB_HEAP - z->used) return NULL;
+    void *p = z->heap + z->used;
+    z->used += n;
+    return p;
+}
+
+static void be_zlib_free(void *opaque, void *p)
+{
+    (void)opaque; (void)p;
+}
+
+static int be_zlib_init(void *st, void *heap)
+{
+    sped_zlib_state *z = st;
+    memset(z, 0, sizeof(*z));
+    z->heap = heap;
+    z->zs.zalloc = be_zlib_alloc;
+    z->zs.zfree = be_zlib_free;
+    z->zs.opaque = z;
+    return SPED_Z(inflateInit)(&z->zs) == Z_OK ? 0 : -1;
+}
+
+/* zlib keeps its own history, so the ring is only an output buffer */
+static int be_zlib_feed(void *st, const uint8_t *in, size_t *in_len,
+                        uint8_t *win, size_t ofs, size_t *out_len, int more)
+{
+    sped_zstream *zs = st;
+    zs->next_in = (uint8_t *)in;
+    zs->avail_in = (uint32_t)*in_len;
+    zs->next_out = win + ofs;
+    zs->avail_out = (uint32_t)*out_len;
+    int ret = SPED_Z(inflate)(zs, Z_NO_FLUSH);
+    *in_len -= zs->avail_in;
+    *out_len -= zs->avail_out;
+    if (ret == Z_STREAM_END) return SPED_INF_DONE;
+    if (ret != Z_OK && ret != Z_BUF_ERROR) return SPED_INF_FAILED;
+    if (zs->avail_out == 0) return SPED_INF_HAS_OUTPUT;
+    return more ? SPED_INF_NEEDS_INPUT : SPED_INF_FAILED;
+}
+
+static int be_zlib_reset(void *st)
+{
+    return SPED_Z(inflateReset)((sped_zstream *)st) == Z_OK ? 0 : -1;
+}
+
+static void be_zlib_end(void *st)
+{
+    SPED_Z(inflateEnd)((sped_zstream *)st);
+}
+
+typedef sped_zlib_state sped_stream_state;
+static const sped_backend sped_stream_backend = {
+    SPED_ZLIB_HEAP, 0, be_zlib_init, be_zlib_feed, be_zlib_reset, be_zlib_end
+};
+
+#elif defined(SPED_INFLATE_BUILTIN)
+
+static int be_builtin_init(void *st, void *heap)
+{
+    (void)heap;
+    inf_init(st);
+    return 0;
+}
+
+/* Keeps fixed-code tables built for an earlier image */
+static int be_builtin_reset(void *st)
+{
+    sped_inflater *z = st;
+    uint32_t fixed = z->fixed;
+    inf_init(z);
+    z->fixed = fixed;
+    return 0;
+}
+
+static int be_builtin_feed(void *st, const uint8_t *in, size_t *in_len,
+                           uint8_t *win, size_t ofs, size_t *out_len, int more)
+{
+    return inf_run(st, in, in_len, win, ofs, out_len, more);
+}
+
+static void be_nop_end(void *st)
+{
+    (void)st;
+}
+
+typedef sped_inflater sped_stream_state;
+static const sped_backend sped_stream_backend = {
+    0, sizeof(sped_inflater), be_builtin_init, be_builtin_feed, be_builtin_reset, be_nop_end
+};
+
+#else /* tinfl */
+
+static int be_tinfl_init(void *st, void *heap)
+{
+    (void)heap;
+    tinfl_init((tinfl_decompressor *)st);
+    return 0;
+}
+
+static int be_tinfl_reset(void *st)
+{
+    tinfl_init((tinfl_decompressor *)st);
+    return 0;
+}
+
+/* tinfl fails with TINFL_STATUS_BAD_PARAM unless ofs + *out_len is the
+ * window size, which img_feed guarantees */
+static int be_tinfl_feed(void *st, const uint8_t *in, size_t *in_len,
+                         uint8_t *win, size_t ofs, size_t *out_len, int more)
+{
+    uint32_t flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+    if (more) flags |= TINFL_FLAG_HAS_MORE_INPUT;
+    return (int)tinfl_decompress(st, in, in_len, win, win + ofs, out_len, flags);
+}
+
+static void be_nop_end(void *st)
+{
+    (void)st;
+}
+
+typedef tinfl_decompressor sped_stream_state;
+static const sped_backend sped_stream_backend = {
+    0, sizeof(tinfl_decompressor), be_tinfl_init, be_tinfl_feed, be_tinfl_reset, be_nop_end
+};
+#endif
+
+#ifdef SPED_INFLATE_LIBDEFLATE
+/* Whole-buffer backend: feed() takes the complete zlib stream in one
+ * piece and the window is the full raw image, so a single
+ * call produces every scanline. */
+typedef struct {
+    struct libdeflate_decompressor *dec;
+} sped_whole_state;
+
+static int be_whole_init(void *st, void *heap)
+{
+    sped_whole_state *ws = st;
+    (void)heap;
+    ws->dec = libdeflate_alloc_decompressor();
+    return ws->dec ? 0 : -1;
+}
+
+static int be_whole_feed(void *st, const uint8_t *in, size_t *in_len,
+                         uint8_t *win, size_t ofs, size_t *out_len, int more)
+{
+    sped_whole_state *ws = st;
+    size_t in_used, got;
+    size_t avail = *out_len;
+    *out_len = 0;   /* all or nothing */
+    (void)more;
+    if (libdeflate_zlib_decompress_ex(ws->dec, in, *in_len, win + ofs, avail,
+                                      &in_used, &got) != LIBDEFLATE_SUCCESS)
+        return SPED_INF_FAILED;
+    *in_len = in_used;
+    *out_len = got;
+    return SPED_INF_DONE;
+}
+
+static int be_whole_reset(void *st)
+{
+    (void)st;
+    return 0;
+}
+
+static void be_whole_end(void *st)
+{
+    libdeflate_free_decompressor(((sped_whole_state *)st)->dec);
+}
+
+static const sped_backend sped_whole_backend = {
+    0, 0, be_whole_init, be_whole_feed, be_whole_reset, be_whole_end
+};
+#endif
+
+
+/* ---- Image decoding ---- */
+
+#ifndef SPED_MAX_BUFFERS
+#define SPED_MAX_BUFFERS 4
+#endif
+
+/* Rotating output buffers. One handed to the callback stays busy until
+ * the consumer releases it, possibly from an interrupt or another thread,
+ * hence the atomic flag accesses. */
+typedef struct {
+    int count;                      /* buffers in rotation, < 2 = off */
+    int next;                       /* buffer the next output goes to */
+    int busy[SPED_MAX_BUFFERS];
+    uint16_t *base;                 /* first buffer, the rest slot pixels apart */
+    size_t slot;
+    void (*wait)(void *user);       /* called while waiting for a buffer */
+    void *wait_user;
+} sped_bufs;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SPED_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SPED_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+#define SPED_LOAD(p)     (*(volatile int *)(p))
+#define SPED_STORE(p, v) (*(volatile int *)(p) = (v))
+#endif
+
+/* Wait until buffer i is released */
+static void bufs_wait(sped_bufs *b, int i)
+{
+    while (SPED_LOAD(&b->busy[i]))
+        if (b->wait) b->wait(b->wait_user);
+}
+
+/* Wait until every buffer is released */
+static void bufs_drain(sped_bufs *b)
+{
+    for (int i = 0; i < b->count; i++) bufs_wait(b, i);
+}
+
+/* A caller's RGB565 surface: w x h pixels, rows pitch bytes apart, the
+ * image placed with its top left pixel at (x0, y0) */
+typedef struct {
+    uint8_t *dst;
+    size_t pitch;
+    int w, h, x0, y0;
+} sped_surf;
+
+/* Per-image state: the row pipeline plus resumable scanline assembly,
+ * so image data can be fed in pieces of any size. */
+typedef struct {
+    sped_dec d;                 /* row pipeline */
+    const sped_backend *be;     /* inflate backend and its state */
+    void *bs;
+    uint8_t *heap;              /* backend heap */
+    uint8_t *win;               /* inflate output window */
+    size_t win_size, win_ofs;
+    size_t row_ofs;             /* window offset of the current row's first byte */
+    int sl_pos;                 /* 0 = expecting filter byte, 1..stride = pixel data */
+    int wide;                   /* rows don't fit the window: copy into cur */
+    int gather;                 /* the current row wraps: the rest goes into cur */
+    size_t pend, pend_n;        /* inflated bytes not yet assembled: offset, count */
+    int st;                     /* last backend status */
+    size_t budget;              /* bytes to assemble before pausing */
+    int pause;                  /* pause after the current row */
+    int stride;
+    uint32_t h;
+    uint8_t ctype;
+    int row0, row1;             /* input rows to convert: from row0, stop at row1 */
+    const uint8_t *in_at, *in_end;  /* image data: next unread byte, end of piece */
+    struct sped_mark *mark;     /* row index being built */
+    uint32_t out_y0, out_y1;    /* output rows, the ROI's */
+    sped_band_cb band_cb;       /* band output, NULL = row by row */
+    void *band_user;
+    sped_row_cb row_cb;         /* the caller's row callback, when d.cb is band_row */
+    void *row_user;
+    sped_span_cb span_cb;       /* rows go out as spans, NULL = whole */
+    void *span_user;
+    sped_span_t *spans;         /* the row's spans */
+    sped_bufs *bufs;            /* rotating buffers, NULL = one */
+    const sped_surf *surf;      /* rows go straight into a surface */
+    int surf_x, surf_n;         /* visible columns: first, count (0 = none) */
+    uint16_t *band;             /* band buffer; d.out walks down it */
+    int band_rows, band_n, band_y;  /* capacity, rows held, first row's y */
+    int adam7, a7_last;         /* interlaced; the last pass to decode */
+    uint32_t emit_y, emit_end;  /* Adam7: canvas rows still to emit */
+    int blend;                  /* alpha blending (or an alpha plane) is on */
+    int *kind;                  /* where to report the alpha met, SPED_OPAQUE.. */
+    uint8_t trns[6];            /* tRNS of a gray or RGB image: its color key */
+    uint32_t trns_n;            /* tRNS bytes seen */
+} sped_img;
+
+/* Band output settings */
+typedef struct {
+    int rows;                   /* rows per band, 0 = no limit */
+    size_t bytes;               /* bytes per band, 0 = no limit */
+    sped_band_cb cb;            /* NULL = bands off */
+    void *user;
+} sped_band;
+
+/* Span output settings */
+typedef struct {
+    sped_span_cb cb;            /* NULL = spans off */
+    void *user;
+} sped_spans;
+
+/* Output size instead of a scale factor */
+typedef struct {
+    uint32_t w, h;
+    int fit;                    /* w x h is a box to fit, keeping the aspect */
+} sped_size;
+
+/* Alpha blending settings */
+typedef struct {
+    int mode;                   /* SPED_ALPHA_* */
+    uint16_t bg;                /* SPED_ALPHA_BG */
+    sped_dst_cb dst;            /* SPED_ALPHA_DST rows, NULL = a surface's own */
+    void *user;
+} sped_alpha;
+
+/* Decode flags this build knows */
+#define SPED_FLAGS (SPED_NEAREST | SPED_PROGRESSIVE)
+
+/* Where an image's rows go besides the row callback; NULLs for plain rows */
+typedef struct {
+    unsigned flags;             /* SPED_FLAGS */
+    const sped_size *size;
+    const sped_band *band;
+    sped_bufs *bufs;
+    const sped_surf *surf;
+    const sped_rect_t *rect;    /* ROI in image pixels */
+    const sped_alpha *alpha;    /* blending, NULL = alpha ignored */
+    const sped_spans *spans;    /* rows as spans (then no bands), NULL = whole */
+    int *kind;                  /* report the image's alpha here at the end */
+    struct sped_mark *mark;     /* build a row index */
+    const sped_index *from;     /* resume from a row index */
+} sped_out;
+
+/* Scaled image: the source's top left sw x sh pixels become ow x oh.
+ * box = 1, 2 or 4 when that is an exact box scale, 0 for the area
+ * filter; nearest = pick pixels instead (never at full size). Interlaced
+ * images (adam7) always pick, from each output pixel's top left corner,
+ * and at any size: their pixels arrive spread over seven passes. With
+ * alpha set, pixels may be blended, and downscales use the area filter:
+ * the box kernels don't weight colors by alpha. plane = the output
+ * buffers have an alpha plane; spans = rows go out as spans. */
+typedef struct {
+    uint32_t ow, oh, sw, sh;
+    int box, nearest, adam7, alpha, plane, spans;
+} sped_geom;
+
+/* Output size for a target size, or a box to fit into (never larger
+ * than the image). -1 if it is empty or would upscale. */
+static int size_fit(const sped_info_t *info, const sped_size *sz,
+                    uint32_t *w, uint32_t *h)
+{
+    uint64_t iw = info->width, ih = info->height;
+    *w = sz->w;
+    *h = sz->h;
+    if (sz->fit && (iw > sz->w || ih > sz->h)) {
+        if (iw * sz->h <= ih * sz->w) {   /* height limits */
+            uint64_t n = iw * sz->h / ih;
+            *w = n ? (uint32_t)n : 1;
+        } else {
+            uint64_t n = ih * sz->w / iw;
+            *h = n ? (uint32_t)n : 1;
+        }
+    } else if (sz->fit) {
+        *w = info->width;
+        *h = info->height;
+    }
+    return *w && *h && *w <= iw && *h <= ih ? 0 : -1;
+}
+
+/* Geometry for an integer scale, or for out's size if it has one. -1 if
+ * the output is empty. */
+static int geom_of(sped_geom *g, const sped_info_t *info, int scale,
+                   const sped_out *out)
+{
+    const sped_size *sz = out ? out->size : NULL;
+    if (sz) {
+        if (size_fit(info, sz, &g->ow, &g->oh) < 0) return -1;
+        g->sw = info->width;
+        g->sh = info->height;
+        g->box = 0;
+        for (uint32_t s = 1; s <= 4; s *= 2)
+            if ((uint64_t)g->ow * s == g->sw && (uint64_t)g->oh * s == g->sh)
+                g->box = (int)s;
+    } else {
+        if (scale < 1) return -1;
+        g->ow = info->width / (uint32_t)scale;
+        g->oh = info->height / (uint32_t)scale;
+        g->sw = g->ow * (uint32_t)scale;   /* a trailing partial block is dropped */
+        g->sh = g->oh * (uint32_t)scale;
+        g->box = scale == 1 || scale == 2 || scale == 4 ? scale : 0;
+        if (!g->ow || !g->oh) return -1;
+    }
+    g->adam7 = info->interlace != 0;
+    g->spans = out && out->spans;   /* which need alpha, blended or not */
+    g->alpha = out && out->alpha && (out->alpha->mode != SPED_ALPHA_IGNORE || g->spans);
+    g->plane = g->alpha && (out->alpha->mode == SPED_ALPHA_PLANE || g->spans);
+    if (g->alpha && g->box > 1) g->box = 0;
+    g->nearest = (out && (out->flags & SPED_NEAREST) && g->box != 1) || g->adam7;
+    return 0;
+}
+
+/* The part of the scaled image that is output, [x0, x1) x [y0, y1) */
+typedef struct {
+    uint32_t x0, x1, y0, y1;
+} sped_win;
+
+/* Output window for a ROI, widened to the output pixels it touches and
+ * clipped to the image; the whole image without one. -1 if it misses the
+ * image. */
+static int out_win(sped_win *wn, const sped_geom *g, const sped_rect_t *r)
+{
+    wn->x0 = wn->y0 = 0;
+    wn->x1 = g->ow;
+    wn->y1 = g->oh;
+    if (r) {
+        uint64_t xe = (((uint64_t)r->x + r->w) * g->ow + g->sw - 1) / g->sw;
+        uint64_t ye = (((uint64_t)r->y + r->h) * g->oh + g->sh - 1) / g->sh;
+        uint64_t x0 = (uint64_t)r->x * g->ow / g->sw;
+        uint64_t y0 = (uint64_t)r->y * g->oh / g->sh;
+        if (xe < wn->x1) wn->x1 = (uint32_t)xe;
+        if (ye < wn->y1) wn->y1 = (uint32_t)ye;
+        wn->x0 = x0 < wn->x1 ? (uint32_t)x0 : wn->x1;
+        wn->y0 = y0 < wn->y1 ? (uint32_t)y0 : wn->y1;
+    }
+    return wn->x0 < wn->x1 && wn->y0 < wn->y1 ? 0 : -1;
+}
+
+/* img_feed result: stopped early, call again to carry on */
+#define IMG_PAUSED 2
+
+/* Workspace carving: every region starts on a SPED_WS_ALIGN boundary */
+#define SPED_WS_ALIGN 32
+#define WS_ROUND(n) (((n) + SPED_WS_ALIGN - 1) & ~(uint64_t)(SPED_WS_ALIGN - 1))
+
+typedef struct {
+    size_t dec, inf, cur, prev, out, plane, spans, acc, plan, canvas, unpack, dict, heap;
+} sped_layout;
+
+/* Bits per pixel for a color type / depth pair, -1 if unsupported */
+static int png_bits(uint8_t ctype, uint8_t depth)
+{
+    int sub = depth == 1 || depth == 2 || depth == 4;
+    if (depth != 8 && depth != 16 && !(sub && (ctype == 0 || ctype == 3))) return -1;
+    switch (ctype) {
+        case 0: return 1 * depth;               /* grayscale */
+        case 2: return 3 * depth;               /* RGB */
+        case 3: return depth <= 8 ? depth : -1; /* indexed (at most 8-bit) */
+        case 4: return 2 * depth;               /* grayscale + alpha */
+        case 6: return 4 * depth;               /* RGBA */
+        default: return -1;
+    }
+}
+
+/* Bytes in a scanline of w pixels, without its filter byte */
+static uint64_t png_row_bytes(uint32_t w, int bits)
+{
+    return ((uint64_t)w * (uint32_t)bits + 7) / 8;
+}
+
+/* Lay out the workspace for a w-pixel-wide image; returns its size
+ * (offsets relative to an aligned base), or 0 if it can't be addressed.
+ * The image-independent regions come first, at fixed offsets, so a
+ * context can keep its decoder and inflate state from image to image. */
+static size_t ws_layout(sped_layout *l, uint32_t w, int bits, const sped_geom *g,
+                        int rows, int nbuf)
+{
+    uint64_t stride = png_row_bytes(w, bits);
+    int bpp = (bits + 7) / 8;
+    uint64_t out_w = g->ow;
+    uint64_t o = 0;
+    if (stride > 0x7FFFFFFF) return 0;   /* rows are indexed with int */
+    l->dec = (size_t)o;  o += WS_ROUND(sizeof(sped_img));
+    l->inf = (size_t)o;  o += WS_ROUND(sizeof(sped_stream_state));
+    l->heap = (size_t)o; o += WS_ROUND(sped_stream_backend.heap);
+    l->dict = (size_t)o; o += WS_ROUND(SPED_WINDOW);
+    l->cur = (size_t)o;  o += WS_ROUND(stride);
+    l->prev = (size_t)o; o += WS_ROUND(stride);
+    l->out = (size_t)o;  o += WS_ROUND(out_w * sizeof(uint16_t) * (uint64_t)rows) * (uint64_t)nbuf;
+    /* alpha plane: a byte for each pixel of the output buffers */
+    l->plane = (size_t)o; o += g->plane ? WS_ROUND(WS_ROUND(out_w * sizeof(uint16_t) *
+                                        (uint64_t)rows) * (uint64_t)nbuf / 2) : 0;
+    /* spans of a row: at most one per two pixels, plus one */
+    l->spans = (size_t)o; o += g->spans ? WS_ROUND((out_w / 2 + 1) * sizeof(sped_span_t)) : 0;
+    if (g->nearest) {
+        /* picked pixels, and which they are */
+        l->acc = (size_t)o;  o += WS_ROUND(out_w * (uint64_t)bpp);
+        l->plan = (size_t)o; o += WS_ROUND(out_w * sizeof(uint32_t));
+    } else {
+        l->acc = (size_t)o;  o += g->box > 1 ? WS_ROUND(out_w * 4 * sizeof(uint16_t)) :
+                                  g->box == 0 ? 2 * WS_ROUND(out_w * (g->alpha ? 4 : 3) *
+                                                             sizeof(uint32_t)) : 0;
+        /* area filter plan: first pixel and count per column, then weights */
+        l->plan = (size_t)o; o += g->box == 0 ? 2 * WS_ROUND(out_w * sizeof(uint32_t)) +
+                                  WS_ROUND(((uint64_t)g->sw + 2 * out_w) * sizeof(uint16_t)) : 0;
+    }
+    /* Adam7: the picks converted, then the whole output image; with
+     * alpha, the alpha of each */
+    l->canvas = (size_t)o; o += g->adam7 ? WS_ROUND(out_w * sizeof(uint16_t)) +
+                                WS_ROUND(out_w * g->oh * sizeof(uint16_t)) : 0;
+    if (g->adam7 && g->alpha) o += WS_ROUND(out_w) + WS_ROUND(out_w * g->oh);
+    /* packed pixels: a byte each, and the table that unpacks them */
+    l->unpack = (size_t)o; o += bits < 8 ? WS_ROUND((uint64_t)w) + WS_ROUND(256 * 8 * sizeof(uint16_t)) : 0;
+    if (o > (uint64_t)(SIZE_MAX - SPED_WS_ALIGN)) return 0;
+    return (size_t)o;
+}
+
+static uint8_t *ws_base(void *ws)
+{
+    return (uint8_t *)(((uintptr_t)ws + SPED_WS_ALIGN - 1) &
+                       ~(uintptr_t)(SPED_WS_ALIGN - 1));
+}
+
+/* Output rows per band for an out_w x out_h image: 1 with bands off */
+static int band_rows(const sped_band *b, uint32_t out_w, uint32_t out_h)
+{
+    uint32_t n = out_h ? out_h : 1;
+    if (!b || !b->cb || out_w == 0) return 1;
+    if (b->rows > 0 && (uint32_t)b->rows < n) n = (uint32_t)b->rows;
+    if (b->bytes) {
+        size_t fit = b->bytes / ((size_t)out_w * sizeof(uint16_t));
+        if (fit < n) n = fit ? (uint32_t)fit : 1;
+    }
+    return (int)n;
+}
+
+/* The IDAT chunk starting at cp, if a whole one fits before end: returns
+ * its data and sets *len, else NULL. IDATs are consecutive, so the image
+ * data ends at the first chunk that isn't one. */
+static const uint8_t *idat_at(const uint8_t *cp, const uint8_t *end, uint32_t *len)
+{
+    if (end - cp < 12) return NULL;
+    uint32_t clen = r32(cp);
+    if (clen > (size_t)(end - cp) - 12 || memcmp(cp + 4, "IDAT", 4) != 0) return NULL;
+    *len = clen;
+    return cp + 8;
+}
+
+/* IHDR data (13 bytes) */
+static void hdr_parse(const uint8_t *ihdr, sped_info_t *info)
+{
+    info->width = r32(ihdr);
+    info->height = r32(ihdr + 4);
+    info->depth = ihdr[8];
+    info->color_type = ihdr[9];
+    info->interlace = ihdr[12];
+}
+
+/* Can this image be decoded? Returns bits per pixel, or -1. Whether
+ * the output size suits it is img_init's call. */
+static int hdr_check(const uint8_t *ihdr)
+{
+    sped_info_t info;
+    hdr_parse(ihdr, &info);
+
+    /* Reject unsupported features */
+    if (ihdr[10] != 0) return -1;  /* compression must be 0 */
+    if (ihdr[11] != 0) return -1;  /* filter must be 0 */
+    if (ihdr[12] > 1) return -1;   /* interlace: none or Adam7 */
+    if (info.width == 0 || info.height == 0) return -1;
+    return png_bits(info.color_type, info.depth);
+}
+
+/* Where output row y goes in the surface: straight into it when the
+ * whole row is visible, else into the out row, to be clipped */
+static uint16_t *surf_row_at(const sped_img *im, int y)
+{
+    const sped_surf *s = im->surf;
+    int64_t dy = (int64_t)s->y0 + y;
+    if (dy < 0 || dy >= s->h) return im->band;
+    uint16_t *row = (uint16_t *)(s->dst + (size_t)dy * s->pitch);
+    if (im->surf_n == (int)im->d.out_w) return row + s->x0;
+    if (im->d.alpha && im->surf_n > 0)   /* blended onto the visible part */
+        memcpy(im->band + im->surf_x, row + (s->x0 + im->surf_x),
+               (size_t)im->surf_n * sizeof(uint16_t));
+    return im->band;
+}
+
+/* Row callback for surface output: copy in a clipped row, and aim the
+ * kernels at the next one */
+static void surf_row(int y, int w, const uint16_t *rgb565, void *user)
+{
+    sped_img *im = user;
+    const sped_surf *s = im->surf;
+    int64_t dy = (int64_t)s->y0 + y;
+    (void)w;
+    if (rgb565 == im->band && im->surf_n > 0 && dy >= 0 && dy < s->h)
+        memcpy((uint16_t *)(s->dst + (size_t)dy * s->pitch) + (s->x0 + im->surf_x),
+               rgb565 + im->surf_x, (size_t)im->surf_n * sizeof(uint16_t));
+    im->d.out = surf_row_at(im, y + 1);
+}
+
+/* Point the output at the next free buffer */
+static void img_take(sped_img *im)
+{
+    sped_bufs *b = im->bufs;
+    if (b) {
+        bufs_wait(b, b->next);
+        im->band = b->base + (size_t)b->next * b->slot;
+    }
+    im->d.out = im->surf ? surf_row_at(im, im->band_y) : im->band;
+}
+
+/* Hand over the row in the band as its spans of pixels that are not
+ * fully transparent; the whole row without alpha. A row that is all
+ * transparent is skipped, and its buffer stays free. */
+static void img_spans(sped_img *im)
+{
+    const sped_dec *d = &im->d;
+    const uint8_t *a = d->alpha ? d->plane + (im->band - d->obase) : NULL;
+    uint32_t w = d->out_w, x = 0;
+    int n = 0;
+    while (x < w) {
+        if (a)
+            while (x < w && !a[x]) x++;
+        if (x == w) break;
+        uint32_t e = x + 1;
+        if (a)
+            while (e < w && a[e]) e++;
+        else
+            e = w;
+        im->spans[n].x = (int)x;
+        im->spans[n].w = (int)(e - x);
+        im->spans[n].rgb565 = im->band + x;
+        n++;
+        x = e;
+    }
+    if (n)
+        im->span_cb(im->band_y, im->spans, n, im->span_user);
+    else if (im->bufs)
+        SPED_STORE(&im->bufs->busy[im->bufs->next], 0);
+}
+
+/* Hand over the rows gathered in the band. more = rows follow, so
+ * take the next buffer now. */
+static void img_flush(sped_img *im, int more)
+{
+    sped_bufs *b = im->bufs;
+    if (im->band_n == 0) return;
+    if (b) SPED_STORE(&b->busy[b->next], 1);   /* the callback may release it */
+    if (im->span_cb)
+        img_spans(im);
+    else if (im->band_cb)
+        im->band_cb(im->band_y, (int)im->d.out_w, im->band_n, im->band, im->band_user);
+    else
+        im->row_cb(im->band_y, (int)im->d.out_w, im->band, im->row_user);
+    im->band_y += im->band_n;
+    im->band_n = 0;
+    if (b) b->next = (b->next + 1) % b->count;
+    if (more) img_take(im);
+}
+
+/* Row callback for bands and rotating buffers: the row is already in
+ * place, move on */
+static void band_row(int y, int w, const uint16_t *rgb565, void *user)
+{
+    sped_img *im = user;
+    (void)y; (void)rgb565;
+    if (++im->band_n == im->band_rows)
+        img_flush(im, (uint32_t)im->band_y + (uint32_t)im->band_rows < im->out_y1);
+    else
+        im->d.out += w;
+}
+
+/* Area filter plan for output columns x0 .. x0+n-1: each covers sw/ow
+ * source pixels, so with pixel x spanning [x*ow, (x+1)*ow) and column i
+ * spanning [i*sw, (i+1)*sw), a pixel's weight is the Q15 share of the
+ * column it overlaps. Shares are taken as differences of rounded running
+ * totals, so every column's weights sum to exactly 32768. */
+static void area_plan(uint32_t *ax, uint32_t *an, uint16_t *aw,
+                      const sped_geom *g, uint32_t x0, uint32_t n)
+{
+    uint64_t sw = g->sw, ow = g->ow;
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t a = (uint64_t)(x0 + i) * sw, b = a + sw;
+        uint32_t x = (uint32_t)(a / ow), c = 0;
+        ax[i] = x;
+        for (; (uint64_t)x * ow < b; x++, c++) {
+            uint64_t u0 = (uint64_t)x * ow, u1 = u0 + ow;
+            u0 = u0 > a ? u0 - a : 0;
+            u1 = (u1 < b ? u1 : b) - a;
+            *aw++ = (uint16_t)((u1 << 15) / sw - (u0 << 15) / sw);
+        }
+        an[i] = c;
+    }
+}
+
+/* Set up the image in workspace ws for a checked header. keep = the
+ * workspace head still holds a decoder from an earlier image, whose
+ * kernel choices and LUT may be reused. */
+static sped_img *img_init(void *ws, size_t ws_size, const sped_info_t *info,
+                          int bits, int scale, sped_row_cb cb, void *user,
+                          const sped_out *out, int keep)
+{
+    sped_layout l;
+    sped_geom g;
+    sped_win wn;
+    const sped_band *band = out ? out->band : NULL;
+    sped_bufs *bufs = out ? out->bufs : NULL;
+    if (geom_of(&g, info, scale, out) < 0 ||
+        out_win(&wn, &g, out ? out->rect : NULL) < 0)
+        return NULL;
+    uint32_t out_w = wn.x1 - wn.x0;
+    int rows = band_rows(band, out_w, wn.y1 - wn.y0);
+    int nbuf = bufs && bufs->count > 1 ? bufs->count : 1;
+    size_t need = ws_layout(&l, info->width, bits, &g, rows, nbuf);
+    uint8_t *wb = ws_base(ws);
+    if (!ws || need == 0 || ws_size < need + (size_t)(wb - (uint8_t *)ws)) return NULL;
+
+    sped_img *im = (sped_img *)(wb + l.dec);
+    sped_dec *d = &im->d;
+    uint8_t ctype = info->color_type;
+    int bpp = (bits + 7) / 8;
+    int bpc = info->depth == 16 ? 2 : 1;   /* packed pixels unpack to 8-bit */
+    if (!keep) {
+        d->fmt = 0;
+        d->lut_gray = 0;
+    }
+    memset(d->pal, 0, sizeof(d->pal));
+    memset(d->pal_a, 255, sizeof(d->pal_a));
+
+    /* Row pipeline, fixed for the whole image */
+    d->cur = wb + l.cur;
+    d->prev = wb + l.prev;
+    d->out = (uint16_t *)(wb + l.out);
+    d->acc = g.box > 1 && !g.nearest ? (uint16_t *)(wb + l.acc) : NULL;
+    d->pick = g.nearest ? wb + l.acc : NULL;
+    d->wacc[0] = g.box == 0 && !g.nearest ? (uint32_t *)(wb + l.acc) : NULL;
+    d->wacc[1] = d->wacc[0] ? d->wacc[0] + out_w * (g.alpha ? 4 : 3) : NULL;
+    unsigned fmt = 1 + ctype + 8u * (unsigned)bpc + 32u * (unsigned)g.box +
+                   256u * (unsigned)g.nearest + 512u * (unsigned)g.adam7 +
+                   1024u * (unsigned)(bits < 8 ? bits : 0) + 16384u * (unsigned)g.alpha;
+    if (d->fmt != fmt) {
+        unfilter_select(d->unf, bpp);
+        d->conv = convert_select(ctype, bpc);
+        d->row_fn = g.adam7 ? row_adam7 : g.nearest ? row_nearest :
+                    row_select(ctype, bpc, g.box);
+        if (bits < 8) {   /* blending needs the pixels, not their RGB565 */
+            d->row_px = d->row_fn;
+            d->row_fn = d->row_fn == row_full && !g.alpha ? row_packed_full : row_packed;
+        }
+        if (g.box > 1)
+            d->acc_nc = box_select(&d->hsum, &d->emit, ctype, bpc, g.box);
+        d->blend = g.alpha ? blend_select(ctype, bpc) : NULL;
+        d->fmt = fmt;
+    }
+    uint64_t xe = ((uint64_t)wn.x1 * g.sw + g.ow - 1) / g.ow;   /* past the last pixel used */
+    d->w = xe < info->width ? (uint32_t)xe : info->width;
+    d->x0 = wn.x0;
+    d->out_w = out_w;
+    d->bpp = bpp;
+    d->bits = bits;
+    d->px = bits < 8 ? wb + l.unpack : NULL;
+    d->unpack8 = NULL;
+    d->unpack565 = NULL;
+    if (bits < 8 && d->row_fn == row_packed)
+        d->unpack8 = (uint8_t (*)[8])(wb + l.unpack + WS_ROUND((uint64_t)info->width));
+    else if (bits < 8)
+        d->unpack565 = (uint16_t (*)[8])(wb + l.unpack + WS_ROUND((uint64_t)info->width));
+    d->cb = cb;
+    d->user = user;
+    const sped_alpha *al = g.alpha ? out->alpha : NULL;
+    im->blend = g.alpha;
+    im->trns_n = 0;
+    d->alpha = 0;   /* until tRNS has had its chance: img_start */
+    d->dst = al ? al->dst : NULL;
+    d->dst_user = al ? al->user : NULL;
+    d->bg_fill = al && al->mode == SPED_ALPHA_BG;
+    d->bg = al ? al->bg : 0;
+    d->plane = g.plane ? wb + l.plane : NULL;
+    d->split = al && (al->mode == SPED_ALPHA_PLANE || al->mode == SPED_ALPHA_IGNORE);
+    d->obase = d->out;
+    im->kind = out ? out->kind : NULL;
+    d->a_oh = g.oh;
+    d->a_sh = g.sh;
+    if (g.nearest) {
+        /* each column's centre pixel, or top left one for Adam7 */
+        uint32_t *ax = (uint32_t *)(wb + l.plan);
+        for (uint32_t i = 0; i < out_w; i++)
+            ax[i] = g.adam7 ? (uint32_t)((uint64_t)(wn.x0 + i) * g.sw / g.ow) :
+                    (uint32_t)(((uint64_t)(wn.x0 + i) * 2 + 1) * g.sw / ((uint64_t)g.ow * 2));
+        d->ax = ax;
+    } else if (g.box == 0) {
+        uint32_t *ax = (uint32_t *)(wb + l.plan);
+        uint32_t *an = (uint32_t *)(wb + l.plan + WS_ROUND((uint64_t)g.ow * sizeof(uint32_t)));
+        uint16_t *aw = (uint16_t *)(wb + l.plan + 2 * WS_ROUND((uint64_t)g.ow * sizeof(uint32_t)));
+        area_plan(ax, an, aw, &g, wn.x0, out_w);
+        d->ax = ax;
+        d->an = an;
+        d->aw = aw;
+    }
+
+    im->be = &sped_stream_backend;
+    im->bs = wb + l.inf;
+    im->heap = wb + l.heap;
+    im->win = wb + l.dict;
+    im->win_size = SPED_WINDOW;
+    im->budget = SIZE_MAX;
+    im->pause = 0;
+    im->stride = (int)png_row_bytes(info->width, bits);
+    im->h = info->height;
+    im->ctype = ctype;
+
+    d->pass = -1;
+    im->adam7 = g.adam7;
+    if (g.adam7) {
+        /* Passes holding a pixel the output shows. The last one ends the
+         * decode; with SPED_PROGRESSIVE every pass up to it is shown. */
+        d->canvas = (uint16_t *)(wb + l.canvas + WS_ROUND((uint64_t)g.ow * sizeof(uint16_t)));
+        d->ctmp = (uint16_t *)(wb + l.canvas);
+        d->atmp = g.alpha ? wb + l.canvas + WS_ROUND((uint64_t)g.ow * sizeof(uint16_t)) +
+                            WS_ROUND((uint64_t)g.ow * g.oh * sizeof(uint16_t)) : NULL;
+        d->acanvas = g.alpha ? d->atmp + WS_ROUND((uint64_t)g.ow) : NULL;
+        d->y0 = wn.y0;
+        d->out_h = wn.y1 - wn.y0;
+        d->w = info->width;
+        d->prog = out && (out->flags & SPED_PROGRESSIVE);
+        d->use = 0;
+        im->a7_last = 0;
+        for (int p = 0; p < 7; p++) {
+            int hx = 0, hy = 0;
+            for (uint32_t i = 0; i < out_w && !hx; i++)
+                hx = adam7_hit(d->ax[i], adam7[p][0], adam7_xsh[p], 1) >= 0;
+            for (uint32_t j = wn.y0; j < wn.y1 && !hy; j++) {
+                uint32_t y = (uint32_t)((uint64_t)j * g.sh / g.oh);
+                hy = y >= adam7[p][1] && (y - adam7[p][1]) % adam7[p][3] == 0;
+            }
+            if (hx && hy) {
+                d->use |= 1u << p;
+                im->a7_last = p;
+            }
+        }
+        if (d->prog) d->use = (2u << im->a7_last) - 1;
+        im->row0 = 0;
+        im->row1 = 0;
+        for (int p = 0; p <= im->a7_last; p++)
+            if (adam7_len(info->width, p, 0))
+                im->row1 += (int)adam7_len(info->height, p, 1);
+    } else if (g.nearest) {   /* from the first picked row to the last */
+        im->row0 = (int)(((uint64_t)wn.y0 * 2 + 1) * g.sh / ((uint64_t)g.oh * 2));
+        im->row1 = (int)(((uint64_t)wn.y1 * 2 - 1) * g.sh / ((uint64_t)g.oh * 2)) + 1;
+    } else {
+        im->row0 = (int)((uint64_t)wn.y0 * g.sh / g.oh);
+        im->row1 = (int)(((uint64_t)wn.y1 * g.sh + g.oh - 1) / g.oh);
+    }
+    im->out_y0 = wn.y0;
+    im->out_y1 = wn.y1;
+    im->mark = out ? out->mark : NULL;
+
+    /* Bands: the kernels write each row into the band in place */
+    im->band_cb = band ? band->cb : NULL;
+    im->band_user = band ? band->user : NULL;
+    im->band = d->out;
+    im->band_rows = rows;
+    im->band_n = 0;
+    im->bufs = NULL;
+    if (nbuf > 1) {
+        /* A buffer still out from the last image may overlap these */
+        size_t slot = (size_t)WS_ROUND(out_w * sizeof(uint16_t) * (uint64_t)rows) / sizeof(uint16_t);
+        if (bufs->base != d->out || bufs->slot != slot) {
+            bufs_drain(bufs);
+            bufs->base = d->out;
+            bufs->slot = slot;
+            bufs->next = 0;
+        }
+        im->bufs = bufs;
+    }
+    im->span_cb = g.spans ? out->spans->cb : NULL;
+    im->span_user = g.spans ? out->spans->user : NULL;
+    im->spans = (sped_span_t *)(wb + l.spans);
+    if (im->band_cb || im->bufs || im->span_cb) {
+        im->row_cb = cb;
+        im->row_user = user;
+        d->cb = band_row;
+        d->user = im;
+    }
+
+    /* Surface: visible columns, clipped to its width */
+    im->surf = out ? out->surf : NULL;
+    if (im->surf) {
+        int64_t x = im->surf->x0, x1 = x + (int64_t)out_w;
+        if (x < 0) x = 0;
+        if (x1 > im->surf->w) x1 = im->surf->w;
+        im->surf_x = (int)(x - im->surf->x0);
+        im->surf_n = x1 > x ? (int)(x1 - x) : 0;
+        d->cb = surf_row;
+        d->user = im;
+    }
+    return im;
+}
+
+/* Bytes off..off+n of a PLTE or tRNS chunk */
+static void img_meta(sped_img *im, const uint8_t *type, uint32_t off,
+                     const uint8_t *p, size_t n)
+{
+    if (memcmp(type, "PLTE", 4) == 0) {
+        uint8_t *pal = &im->d.pal[0][0];
+        for (size_t i = 0; i < n && off + i < sizeof(im->d.pal); i++)
+            pal[off + i] = p[i];
+    } else if (memcmp(type, "tRNS", 4) == 0) {
+        for (size_t i = 0; i < n && off + i < 256; i++) {
+            if (im->ctype == 3) im->d.pal_a[off + i] = p[i];
+            else if (off + i < sizeof(im->trns)) im->trns[off + i] = p[i];
+        }
+        im->trns_n = off + (uint32_t)n;
+    }
+}
+
+/* Move on to the next Adam7 pass that has pixels, up to the last one
+ * decoded */
+static void adam7_next(sped_img *im)
+{
+    sped_dec *d = &im->d;
+    while (++d->pass <= im->a7_last) {
+        d->pw = adam7_len(d->w, d->pass, 0);
+        d->ph = adam7_len(im->h, d->pass, 1);
+        if (d->pw && d->ph) break;
+    }
+    d->py = 0;
+    im->stride = (int)png_row_bytes(d->pw, d->bits);
+    memset(d->prev, 0, (size_t)im->stride);   /* each pass starts afresh */
+}
+
+/* Emit the canvas rows due. Returns 1 if pause was set first. */
+static int img_drain(sped_img *im)
+{
+    sped_dec *d = &im->d;
+    while (im->emit_y < im->emit_end) {
+        if (im->pause) return 1;
+        size_t at = (size_t)(im->emit_y - d->y0) * d->out_w;
+        if (d->alpha && !d->split) {
+            row_under(d, (int)im->emit_y);
+            alpha_over(d->out, d->canvas + at, d->acanvas + at, d->out_w);
+        } else {
+            memcpy(d->out, d->canvas + at, d->out_w * sizeof(uint16_t));
+        }
+        if (d->alpha && d->plane)
+            memcpy(d->plane + (d->out - d->obase), d->acanvas + at, d->out_w);
+        d->cb((int)im->emit_y, (int)d->out_w, d->out, d->user);
+        if (++im->emit_y == im->emit_end && d->row < im->row1) {
+            /* a refinement follows, from the top again */
+            img_flush(im, 0);
+            im->band_y = (int)im->out_y0;
+            img_take(im);
+        }
+    }
+    return 0;
+}
+
+/* An Adam7 pass is complete: queue the canvas if it is to be shown now,
+ * and start the next pass. Returns 1 if emitting paused. */
+static int img_pass(sped_img *im)
+{
+    sped_dec *d = &im->d;
+    if (d->pass == im->a7_last || (d->prog && (d->use >> d->pass & 1))) {
+        im->emit_y = im->out_y0;
+        im->emit_end = im->out_y1;
+    }
+    adam7_next(im);
+    return img_drain(im);
+}
+
+/* Whether this image is blended, now tRNS is in: it is when blending is
+ * on and the image has an alpha channel, palette alpha or a color key.
+ * The key becomes a zero pal_a entry for gray levels of up to 8 bits
+ * (scaled to 8 bits as packed pixels are unpacked), else the pixel's
+ * bytes to compare; an 8-bit RGB key that doesn't fit in 8 bits never
+ * matches. */
+static void alpha_start(sped_img *im)
+{
+    sped_dec *d = &im->d;
+    const uint8_t *t = im->trns;
+    uint8_t c = im->ctype;
+    int bits = d->bits;
+    d->alpha = 0;
+    d->seen = 0;
+    if (!im->blend) return;
+    if (c == 4 || c == 6 || (c == 3 && im->trns_n > 0)) {
+        d->alpha = 1;
+    } else if (c == 0 && im->trns_n >= 2) {
+        uint32_t k = (uint32_t)t[0] << 8 | t[1], m = (1u << (bits < 16 ? bits : 8)) - 1;
+        if (bits == 16) {
+            memcpy(d->key, t, 2);
+            d->alpha = 1;
+        } else if (k <= m) {
+            d->pal_a[k * 255 / m] = 0;
+            d->alpha = 1;
+        }
+    } else if (c == 2 && im->trns_n >= 6) {
+        if (bits == 48) {
+            memcpy(d->key, t, 6);
+            d->alpha = 1;
+        } else if (!t[0] && !t[2] && !t[4]) {
+            d->key[0] = t[1];
+            d->key[1] = t[3];
+            d->key[2] = t[5];
+            d->alpha = 1;
+        }
+    }
+}
+
+/* Image data begins: build the LUT now PLTE is in, clear the filter and
+ * downscale state and start the streaming backend (another backend is
+ * started by whoever chose it). live as for decode(). */
+static int img_start(sped_img *im, int *live)
+{
+    sped_dec *d = &im->d;
+    if (im->ctype == 3 || ((im->ctype == 0 || im->ctype == 4) && !d->lut_gray)) {
+        lut_build(d->lut, im->ctype, (const uint8_t (*)[3])d->pal);
+        d->lut_gray = im->ctype != 3;
+    }
+    if (d->bits < 8) unpack_build(d, im->ctype);
+    alpha_start(im);
+    memset(d->prev, 0, (size_t)im->stride);   /* row -1 is all zero */
+    if (d->acc) memset(d->acc, 0, d->out_w * (uint32_t)d->acc_nc * sizeof(uint16_t));
+    if (d->wacc[0]) {
+        size_t n = d->out_w * (im->blend ? 4 : 3) * sizeof(uint32_t);
+        memset(d->wacc[0], 0, n);
+        memset(d->wacc[1], 0, n);
+    }
+    d->row = 0;
+    d->out_row = (int)im->out_y0;
+    im->band_n = 0;
+    im->band_y = (int)im->out_y0;
+    img_take(im);
+
+    /* Rows that fit the window are unfiltered straight out of it; only a
+     * row that wraps around the end of the window is first gathered into
+     * cur. Rows wider than the window would be overwritten before they
+     * complete, so they are copied into cur as they arrive. */
+    im->win_ofs = 0;
+    im->row_ofs = 0;
+    im->sl_pos = 0;
+    im->wide = (size_t)im->stride > im->win_size;
+    im->gather = 0;
+    im->pend = im->pend_n = 0;
+    im->emit_y = im->emit_end = 0;
+    if (im->adam7) {
+        d->pass = -1;
+        adam7_next(im);
+    }
+    im->st = SPED_INF_HAS_OUTPUT;
 
-/* PNG file signature */
-static const uint8_t png_sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (im->be != &sped_stream_backend)
+        return 0;
+    if (live && *live) {
+        if (im->be->reset(im->bs) < 0) {
+            im->be->end(im->bs);
+            *live = 0;
+            return -1;
+        }
+        return 0;
+    }
+    if (im->be->init(im->bs, im->heap) < 0) return -1;
+    if (live) *live = 1;
+    return 0;
+}
 
-/* Read 4-byte big-endian integer */
-static uint32_t r32(const uint8_t *p)
+/* Flush the last band, report the alpha met and stop the backend, unless
+ * a context keeps it running */
+static void img_end(sped_img *im, int *live)
 {
-    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
-           ((uint32_t)p[2] << 8) | p[3];
+    img_flush(im, 0);
+    if (im->kind)
+        *im->kind = !im->blend ? -1 : im->d.seen & 2 ? SPED_ALPHA_PARTIAL :
+                    im->d.seen & 1 ? SPED_ALPHA_BINARY : SPED_OPAQUE;
+    if (!live || im->be != &sped_stream_backend) im->be->end(im->bs);
+}
+
+/* ---- Row index ----
+ * Checkpoints every `every` rows of a full decode, each holding what it
+ * takes to carry on from that row: the input position, the inflate
+ * state, the window (dictionary plus inflated bytes not yet assembled)
+ * and the previous scanline. The index is one flat block, so it can be
+ * stored as is and used again with the same file and the same build. */
+
+#define SPED_INDEX_MAGIC 0x58445053u  /* "SPDX" */
+
+struct sped_index {
+    uint32_t magic;
+    uint32_t snap, win;         /* backend state and window bytes */
+    uint32_t width, height, stride;
+    uint32_t every, count;      /* checkpoint spacing in rows, checkpoints */
+    uint64_t size;              /* whole index, bytes */
+    uint64_t png_len;           /* file it was built from */
+    uint64_t ck_size;           /* bytes per checkpoint */
+};
+
+/* Checkpoint header; state, window and previous row follow */
+typedef struct {
+    uint64_t in_off, in_left;   /* next input byte: file offset, bytes left in its IDAT */
+    uint32_t row;               /* rows done */
+    int32_t st;                 /* backend status */
+    uint32_t win_ofs, pend, pend_n;
+    uint32_t pad;
+} sped_ckpt;
+
+/* Index under construction */
+typedef struct sped_mark {
+    sped_index *idx;
+    const uint8_t *base;        /* the file */
+    uint32_t n;                 /* checkpoints taken */
+} sped_mark;
+
+#define IDX_HEAD WS_ROUND(sizeof(sped_index))
+
+static sped_ckpt *idx_ckpt(const sped_index *idx, uint32_t i)
+{
+    return (sped_ckpt *)((uint8_t *)idx + IDX_HEAD + (size_t)i * idx->ck_size);
 }
 
-/* Paeth predictor (PNG filter type 4) */
-static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+/* A row is done: take a checkpoint if it is due. pend/pend_n are the
+ * window bytes img_rows still has to assemble. */
+static void idx_mark(sped_img *im, size_t pend, size_t pend_n)
 {
-    int p = (int)a + (int)b - (int)c;
-    int pa = p - (int)a; if (pa < 0) pa = -pa;
-    int pb = p - (int)b; if (pb < 0) pb = -pb;
-    int pc = p - (int)c; if (pc < 0) pc = -pc;
-    if (pa <= pb && pa <= pc) return a;
-    if (pb <= pc) return b;
-    return c;
+    sped_mark *m = im->mark;
+    sped_index *idx = m->idx;
+    if (im->d.row % (int)idx->every != 0 || m->n >= idx->count) return;
+
+    sped_ckpt *ck = idx_ckpt(idx, m->n++);
+    uint8_t *p = (uint8_t *)(ck + 1);
+    ck->in_off = (uint64_t)(im->in_at - m->base);
+    ck->in_left = (uint64_t)(im->in_end - im->in_at);
+    ck->row = (uint32_t)im->d.row;
+    ck->st = im->st;
+    ck->win_ofs = (uint32_t)im->win_ofs;
+    ck->pend = (uint32_t)pend;
+    ck->pend_n = (uint32_t)pend_n;
+    ck->pad = 0;
+    memcpy(p, im->bs, idx->snap);
+    memcpy(p + idx->snap, im->win, idx->win);
+    memcpy(p + idx->snap + idx->win, im->d.prev, idx->stride);
 }
 
-/* Extract RGB from decoded scanline based on color type and bit depth.
- * For 16-bit channels, takes the high byte (lossy but correct for RGB565). */
-static void get_pixel(const uint8_t *cur, uint32_t x, uint8_t ctype,
-                      int bpc, const uint8_t pal[][3],
-                      uint8_t *r, uint8_t *g, uint8_t *b)
+/* Carry on from checkpoint ck of a started image */
+static void img_resume(sped_img *im, const sped_index *idx, const sped_ckpt *ck)
 {
-    if (bpc == 1) {
-        switch (ctype) {
-            case 0: *r = *g = *b = cur[x]; break;
-            case 2: *r = cur[x*3]; *g = cur[x*3+1]; *b = cur[x*3+2]; break;
-            case 3: { uint8_t idx = cur[x];
-                      *r = pal[idx][0]; *g = pal[idx][1]; *b = pal[idx][2]; break; }
-            case 4: *r = *g = *b = cur[x*2]; break;
-            case 6: *r = cur[x*4]; *g = cur[x*4+1]; *b = cur[x*4+2]; break;
-            default: *r = *g = *b = 0;
+    const uint8_t *p = (const uint8_t *)(ck + 1);
+    memcpy(im->bs, p, idx->snap);
+    memcpy(im->win, p + idx->snap, idx->win);
+    memcpy(im->d.prev, p + idx->snap + idx->win, idx->stride);
+    im->d.row = (int)ck->row;
+    im->st = ck->st;
+    im->win_ofs = ck->win_ofs;
+    im->pend = ck->pend;
+    im->pend_n = ck->pend_n;
+}
+
+/* Assemble rows from the inflated bytes waiting in the window, emitting
+ * each one as it completes. Returns 1 if it stopped early: the budget
+ * ran out, or pause was set during a row. */
+static int img_rows(sped_img *im)
+{
+    sped_dec *d = &im->d;
+    uint8_t *win = im->win;
+    size_t win_size = im->win_size;
+    int stride = im->stride;
+    const uint8_t *dp = win + im->pend;
+    size_t avail = im->pend_n;
+    int stop = img_drain(im);
+
+    while (!stop && avail > 0 && d->row < im->row1) {
+        if (im->budget == 0 || im->pause) {
+            stop = 1;
+            break;
         }
-    } else {
-        /* 16-bit: take high byte of each channel */
-        switch (ctype) {
-            case 0: *r = *g = *b = cur[x*2]; break;
-            case 2: *r = cur[x*6]; *g = cur[x*6+2]; *b = cur[x*6+4]; break;
-            case 4: *r = *g = *b = cur[x*4]; break;
-            case 6: *r = cur[x*8]; *g = cur[x*8+2]; *b = cur[x*8+4]; break;
-            default: *r = *g = *b = 0;
+        if (im->sl_pos == 0) {
+            d->filter = *dp++;
+            if (d->filter > 4) d->filter = 0;  /* unknown filter: leave bytes as-is */
+            avail--;
+            im->budget--;
+            im->sl_pos = 1;
+            im->gather = 0;
+            im->row_ofs = (size_t)(dp - win);
+            if (im->row_ofs == win_size) im->row_ofs = 0;
+        } else {
+            size_t need = (size_t)(stride - (im->sl_pos - 1));
+            size_t take = (avail < need) ? avail : need;
+            if (take > im->budget) take = im->budget;
+            if (im->wide || im->gather) memcpy(d->cur + (im->sl_pos - 1), dp, take);
+            dp += take;
+            avail -= take;
+            im->budget -= take;
+            im->sl_pos += (int)take;
+
+            if (im->sl_pos > stride) {
+                /* Scanline complete — unfilter, convert, emit */
+                d->src = im->wide || im->gather ? d->cur : win + im->row_ofs;
+                if (d->row >= im->row0)
+                    d->row_fn(d);
+                else   /* above the ROI: only keep the filter chain going */
+                    d->unf[d->filter](d->cur, d->src, d->prev, 0,
+                                      (int)png_row_bytes(d->w, d->bits));
+
+                /* Swap cur/prev */
+                uint8_t *tmp = d->prev; d->prev = d->cur; d->cur = tmp;
+                d->row++;
+                im->sl_pos = 0;
+                if (im->mark) idx_mark(im, (size_t)(dp - win), avail);
+                if (im->adam7 && ++d->py == d->ph) {
+                    stop = img_pass(im);
+                    stride = im->stride;
+                }
+            }
         }
     }
+    if (im->pause && (d->row < im->row1 || im->emit_y < im->emit_end)) stop = 1;
+    im->pause = 0;
+    im->pend = (size_t)(dp - win);
+    im->pend_n = avail;
+    return stop;
 }
 
-/* Max IDAT chunks we track */
-#define SPED_MAX_IDAT 64
+/* Inflate a piece of image data and emit every row it completes.
+ * more = further image data follows. On return *len holds the bytes
+ * consumed. Returns 1 once the image is done (all rows out, to the last
+ * in the ROI, or the zlib stream ended), 0 when it needs more data,
+ * IMG_PAUSED when img_rows stopped early (call again with the rest of
+ * the piece), -1 on error. */
+static int img_feed(sped_img *im, const uint8_t *in, size_t *len, int more)
+{
+    size_t left = *len;
+    int r;
+
+    im->in_at = in;
+    im->in_end = in + left;
+    for (;;) {
+        if (img_rows(im)) {
+            r = IMG_PAUSED;
+            break;
+        }
+        if (im->d.row >= im->row1 || im->st == SPED_INF_DONE) {
+            r = 1;   /* all rows needed, or end of zlib stream */
+            break;
+        }
+        if (im->st < 0) {
+            r = -1;
+            break;
+        }
+        if (im->st == SPED_INF_NEEDS_INPUT && left == 0 && more) {
+            r = 0;
+            break;
+        }
+        if (im->budget == 0) {
+            r = IMG_PAUSED;
+            break;
+        }
+
+        /* Inflate fills the window up to its end, over a partial row that
+         * wraps around it: move that row into cur first */
+        if (!im->wide && !im->gather && im->sl_pos > 1 && im->row_ofs > im->win_ofs) {
+            size_t n = (size_t)(im->sl_pos - 1), n1 = im->win_size - im->row_ofs;
+            memcpy(im->d.cur, im->win + im->row_ofs, n1);
+            memcpy(im->d.cur + n1, im->win, n - n1);
+            im->gather = 1;
+        }
+
+        size_t in_bytes = left;
+        size_t out_bytes = im->win_size - im->win_ofs;
+
+        int st = im->be->feed(im->bs, in, &in_bytes, im->win, im->win_ofs, &out_bytes, more);
+        if (st == SPED_INF_NEEDS_INPUT && !more) st = SPED_INF_FAILED;
+        in += in_bytes;
+        left -= in_bytes;
+        im->in_at = in;
+        im->st = st;
+        im->pend = im->win_ofs;
+        im->pend_n = out_bytes;
+        im->win_ofs += out_bytes;
+        if (im->win_ofs == im->win_size) im->win_ofs = 0;
+    }
+    *len -= left;
+    return r;
+}
 
 int sped_info(const void *png, size_t len, sped_info_t *info)
 {
@@ -77,234 +3328,772 @@ int sped_info(const void *png, size_t len, sped_info_t *info)
     if (len < 33 || memcmp(p, png_sig, 8) != 0) return -1;
     p += 8;
     if (r32(p) != 13 || memcmp(p + 4, "IHDR", 4) != 0) return -1;
-    info->width = r32(p + 8);
-    info->height = r32(p + 12);
+    hdr_parse(p + 8, info);
     return 0;
 }
 
-int sped_decode(const void *png, size_t len, int scale,
-                sped_row_cb cb, void *user)
+/* Workspace size for an image with the given output settings */
+static size_t ws_need(const sped_info_t *info, int scale, const sped_out *out)
 {
-    if (scale != 1 && scale != 2 && scale != 4) return -1;
-
-    const uint8_t *base = png;
-    const uint8_t *end = base + len;
-
-    /* Signature */
-    if (len < 33 || memcmp(base, png_sig, 8) != 0) return -1;
-
-    /* IHDR must be the first chunk */
-    const uint8_t *p = base + 8;
-    if (r32(p) != 13 || memcmp(p + 4, "IHDR", 4) != 0) return -1;
-
-    const uint8_t *ihdr = p + 8;
-    uint32_t w = r32(ihdr);
-    uint32_t h = r32(ihdr + 4);
-    uint8_t depth = ihdr[8];
-    uint8_t ctype = ihdr[9];
+    const sped_band *band = out ? out->band : NULL;
+    const sped_bufs *bufs = out ? out->bufs : NULL;
+    sped_layout l;
+    sped_geom g;
+    sped_win wn;
+    int bits = png_bits(info->color_type, info->depth);
+    if (bits < 0 || geom_of(&g, info, scale, out) < 0 ||
+        out_win(&wn, &g, out ? out->rect : NULL) < 0)
+        return 0;
+    int rows = band_rows(band, wn.x1 - wn.x0, wn.y1 - wn.y0);
+    int nbuf = bufs && bufs->count > 1 ? bufs->count : 1;
+    size_t n = ws_layout(&l, info->width, bits, &g, rows, nbuf);
+    return n ? n + SPED_WS_ALIGN - 1 : 0;
+}
 
-    /* Reject unsupported features */
-    if (ihdr[10] != 0) return -1;  /* compression must be 0 */
-    if (ihdr[11] != 0) return -1;  /* filter must be 0 */
-    if (ihdr[12] != 0) return -1;  /* interlace not supported */
-    if (depth != 8 && depth != 16) return -1;
-    if (depth == 16 && ctype == 3) return -1;  /* 16-bit indexed doesn't exist */
-    if (w == 0 || h == 0) return -1;
+size_t sped_workspace_size(const sped_info_t *info, int scale, unsigned flags)
+{
+    sped_out out = { .flags = flags };
+    return flags & ~(unsigned)SPED_FLAGS ? 0 : ws_need(info, scale, &out);
+}
 
-    /* Bytes per pixel (16-bit channels = 2 bytes each) */
-    int bpc = depth / 8;  /* bytes per channel: 1 or 2 */
-    int bpp;
-    switch (ctype) {
-        case 0: bpp = 1 * bpc; break;  /* grayscale */
-        case 2: bpp = 3 * bpc; break;  /* RGB */
-        case 3: bpp = 1;       break;  /* indexed (always 8-bit) */
-        case 4: bpp = 2 * bpc; break;  /* grayscale + alpha */
-        case 6: bpp = 4 * bpc; break;  /* RGBA */
-        default: return -1;
+#ifdef SPED_INFLATE_LIBDEFLATE
+/* Bytes of filtered scanlines in the image data */
+static uint64_t raw_size(const sped_info_t *info, int bits)
+{
+    uint64_t n = 0;
+    if (!info->interlace)
+        return (uint64_t)info->height * (png_row_bytes(info->width, bits) + 1);
+    for (int p = 0; p < 7; p++) {
+        uint32_t pw = adam7_len(info->width, p, 0);
+        if (pw) n += adam7_len(info->height, p, 1) * (png_row_bytes(pw, bits) + 1);
     }
-    int stride = (int)(w * bpp);
+    return n;
+}
+#endif
 
-    /* Output dimensions */
-    uint32_t out_w = w / (uint32_t)scale;
-    uint32_t out_h = h / (uint32_t)scale;
-    if (out_w == 0 || out_h == 0) return -1;
+/* Decode a whole PNG into a caller workspace. With heap set
+ * (sped_decode's own workspace) the whole-image libdeflate path may also
+ * malloc. live is NULL for a one-shot workspace; for a context it tracks
+ * whether the workspace head already holds a decoder and a started
+ * inflate backend, which are then reused and left running. */
+static int decode(const uint8_t *base, size_t len, int scale,
+                  sped_row_cb cb, void *user, const sped_out *out,
+                  void *ws, size_t ws_size, int heap, int *live)
+{
+    const uint8_t *end = base + len;
 
-    /* Scan chunks: collect PLTE, tRNS, IDAT pointers */
-    uint8_t pal[256][3];
-    uint8_t pal_a[256];
-    memset(pal_a, 255, sizeof(pal_a));
+    /* Signature, and IHDR must be the first chunk */
+    sped_info_t info;
+    if (sped_info(base, len, &info) != 0) return -1;
+    int bits = hdr_check(base + 16);
+    if (bits < 0) return -1;
+    sped_img *im = img_init(ws, ws_size, &info, bits, scale, cb, user, out,
+                            live && *live);
+    if (!im) return -1;
 
-    struct { const uint8_t *data; uint32_t len; } idat[SPED_MAX_IDAT];
-    int nidat = 0;
+    /* Walk the chunks before the image data: PLTE, tRNS */
+    const uint8_t *in_ptr = NULL;     /* current IDAT data */
+    size_t in_len = 0;
 
     const uint8_t *cp = base + 8 + 25; /* after signature + IHDR (25 = 4+4+13+4) */
     while (cp + 12 <= end) {
         uint32_t clen = r32(cp);
         if (cp + 12 + clen > end) break;
 
-        if (memcmp(cp + 4, "PLTE", 4) == 0) {
-            int n = (int)(clen / 3);
-            if (n > 256) n = 256;
-            for (int i = 0; i < n; i++) {
-                pal[i][0] = cp[8 + i * 3];
-                pal[i][1] = cp[8 + i * 3 + 1];
-                pal[i][2] = cp[8 + i * 3 + 2];
-            }
-        } else if (memcmp(cp + 4, "tRNS", 4) == 0) {
-            if (ctype == 3) {
-                for (uint32_t i = 0; i < clen && i < 256; i++)
-                    pal_a[i] = cp[8 + i];
-            }
-        } else if (memcmp(cp + 4, "IDAT", 4) == 0) {
-            if (nidat < SPED_MAX_IDAT) {
-                idat[nidat].data = cp + 8;
-                idat[nidat].len = clen;
-                nidat++;
-            }
+        if (memcmp(cp + 4, "IDAT", 4) == 0) {
+            in_ptr = cp + 8;
+            in_len = clen;
+            break;
         } else if (memcmp(cp + 4, "IEND", 4) == 0) {
             break;
         }
+        img_meta(im, cp + 4, 0, cp + 8, clen);
         cp += 12 + clen;
     }
-    if (nidat == 0) return -1;
+    if (!in_ptr) return -1;
+
+    /* IDAT chunks are walked lazily as inflate consumes them */
+    uint32_t next_len = 0;
+    const uint8_t *next = idat_at(in_ptr + in_len + 4, end, &next_len);
+    uint8_t *whole = NULL, *whole_in = NULL;
+#ifdef SPED_INFLATE_LIBDEFLATE
+    /* Whole image in one call when it fits; multi-IDAT input is joined */
+    sped_whole_state whole_st;
+    uint64_t raw = raw_size(&info, bits);
+    if (heap && raw <= SPED_WHOLE_MAX) {
+        size_t total = in_len;
+        const uint8_t *q;
+        uint32_t n;
+        for (q = next, n = next_len; q; q = idat_at(q + n + 4, end, &n))
+            total += n;
+        whole = malloc((size_t)raw);
+        if (next && whole) {
+            whole_in = malloc(total);
+            if (whole_in) {
+                size_t o = 0;
+                for (q = in_ptr, n = in_len; q; q = idat_at(q + n + 4, end, &n)) {
+                    memcpy(whole_in + o, q, n);
+                    o += n;
+                }
+            }
+        }
+        if (whole && (!next || whole_in) &&
+            sped_whole_backend.init(&whole_st, NULL) == 0) {
+            im->be = &sped_whole_backend;
+            im->bs = &whole_st;
+            im->win = whole;
+            im->win_size = (size_t)raw;
+            if (whole_in) {
+                in_ptr = whole_in;
+                in_len = total;
+            }
+            next = NULL;
+        } else {
+            free(whole); free(whole_in);
+            whole = whole_in = NULL;
+        }
+    }
+#else
+    (void)heap;
+#endif
+
+    int r = img_start(im, live);
+    if (r == 0 && out && out->from) {
+        /* Resume from the last checkpoint at or above the first row wanted */
+        const sped_index *idx = out->from;
+        uint32_t k = (uint32_t)im->row0 / idx->every;
+        if (k > idx->count) k = idx->count;
+        const sped_ckpt *ck = k ? idx_ckpt(idx, k - 1) : NULL;
+        if (ck && ck->in_off + ck->in_left + 4 <= len) {
+            img_resume(im, idx, ck);
+            in_ptr = base + ck->in_off;
+            in_len = (size_t)ck->in_left;
+            next = idat_at(in_ptr + in_len + 4, end, &next_len);
+        } else if (ck) {
+            r = -1;
+        }
+    }
+    if (r == 0) {
+        for (;;) {
+            r = img_feed(im, in_ptr, &in_len, next != NULL);
+            if (r != 0) break;
+            if (!next) {
+                r = -1;
+                break;
+            }
+            in_ptr = next;
+            in_len = next_len;
+            next = idat_at(in_ptr + in_len + 4, end, &next_len);
+        }
+        img_end(im, live);
+    }
+    free(whole); free(whole_in);
+    return r < 0 ? -1 : 0;
+}
+
+int sped_decode_ws(const void *png, size_t len, int scale, unsigned flags,
+                   sped_row_cb cb, void *user, void *ws, size_t ws_size)
+{
+    sped_out out = { .flags = flags };
+    if (flags & ~(unsigned)SPED_FLAGS) return -1;
+    return decode(png, len, scale, cb, user, &out, ws, ws_size, 0, NULL);
+}
+
+/* Decode with a workspace of our own */
+static int decode_heap(const void *png, size_t len, int scale, sped_row_cb cb,
+                       void *user, const sped_out *out)
+{
+    sped_info_t info;
+    if (sped_info(png, len, &info) != 0) return -1;
+    size_t n = ws_need(&info, scale, out);
+    if (n == 0) return -1;
+    void *ws = malloc(n);
+    if (!ws) return -1;
+    int ret = decode(png, len, scale, cb, user, out, ws, n, 1, NULL);
+    free(ws);
+    return ret;
+}
+
+int sped_decode(const void *png, size_t len, int scale,
+                sped_row_cb cb, void *user)
+{
+    return decode_heap(png, len, scale, cb, user, NULL);
+}
+
+int sped_decode_rect(const void *png, size_t len, int scale,
+                     const sped_rect_t *rect, sped_row_cb cb, void *user)
+{
+    sped_out out = { .rect = rect };
+    return decode_heap(png, len, scale, cb, user, &out);
+}
+
+int sped_decode_size(const void *png, size_t len, uint32_t w, uint32_t h,
+                     int fit, sped_row_cb cb, void *user)
+{
+    sped_size sz = { w, h, fit };
+    sped_out out = { .size = &sz };
+    return decode_heap(png, len, 1, cb, user, &out);
+}
+
+int sped_scaled_size(const sped_info_t *info, uint32_t w, uint32_t h, int fit,
+                     uint32_t *out_w, uint32_t *out_h)
+{
+    sped_size sz = { w, h, fit };
+    return size_fit(info, &sz, out_w, out_h);
+}
+
+static int to_buffer(const void *png, size_t len, int scale, uint16_t *dst,
+                     size_t pitch, int dst_w, int dst_h, int x0, int y0,
+                     const sped_alpha *alpha)
+{
+    sped_surf surf = { (uint8_t *)dst, pitch, dst_w, dst_h, x0, y0 };
+    sped_out out = { .surf = &surf, .alpha = alpha };
+    if (!dst || dst_w < 0 || dst_h < 0) return -1;
+    return decode_heap(png, len, scale, NULL, NULL, &out);
+}
+
+int sped_decode_to_buffer(const void *png, size_t len, int scale,
+                          uint16_t *dst, size_t pitch, int dst_w, int dst_h,
+                          int x0, int y0)
+{
+    return to_buffer(png, len, scale, dst, pitch, dst_w, dst_h, x0, y0, NULL);
+}
+
+int sped_blend_to_buffer(const void *png, size_t len, int scale,
+                         uint16_t *dst, size_t pitch, int dst_w, int dst_h,
+                         int x0, int y0)
+{
+    sped_alpha al = { SPED_ALPHA_DST, 0, NULL, NULL };   /* the surface's pixels */
+    return to_buffer(png, len, scale, dst, pitch, dst_w, dst_h, x0, y0, &al);
+}
+
+static void row_none(int y, int w, const uint16_t *rgb565, void *user)
+{
+    (void)y; (void)w; (void)rgb565; (void)user;
+}
+
+sped_index *sped_index_build(const void *png, size_t len, int every,
+                             sped_row_cb cb, void *user)
+{
+    sped_info_t info;
+    sped_mark m;
+    if (sped_stream_backend.snap == 0 || every < 1 || sped_info(png, len, &info) != 0)
+        return NULL;
+    int bits = png_bits(info.color_type, info.depth);
+    if (bits < 0 || info.height == 0 || info.interlace) return NULL;
+
+    /* Multiples of 4 rows, so every scale can start at a checkpoint */
+    uint32_t ev = ((uint32_t)every + 3) & ~3u;
+    uint64_t stride = png_row_bytes(info.width, bits);
+    uint64_t ck_size = WS_ROUND(sizeof(sped_ckpt) + sped_stream_backend.snap + SPED_WINDOW + stride);
+    uint32_t count = (info.height - 1) / ev;
+    uint64_t size = IDX_HEAD + ck_size * count;
+    if (stride > 0x7FFFFFFF || size > SIZE_MAX) return NULL;
+
+    size_t n = ws_need(&info, 1, NULL);
+    sped_index *idx = n ? malloc((size_t)size) : NULL;
+    void *ws = idx ? malloc(n) : NULL;
+    if (!ws) {
+        free(idx);
+        return NULL;
+    }
+    idx->magic = SPED_INDEX_MAGIC;
+    idx->snap = (uint32_t)sped_stream_backend.snap;
+    idx->win = SPED_WINDOW;
+    idx->width = info.width;
+    idx->height = info.height;
+    idx->stride = (uint32_t)stride;
+    idx->every = ev;
+    idx->count = count;
+    idx->size = size;
+    idx->png_len = len;
+    idx->ck_size = ck_size;
+
+    /* A full decode with the streaming backend, marking as it goes */
+    sped_out out = { .mark = &m };
+    m.idx = idx;
+    m.base = png;
+    m.n = 0;
+    int r = decode(png, len, 1, cb ? cb : row_none, user, &out, ws, n, 0, NULL);
+    free(ws);
+    if (r < 0 || m.n != count) {
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
 
-    /* Allocate work buffers */
-    uint8_t *cur = calloc(1, stride);
-    uint8_t *prev = calloc(1, stride);
-    uint16_t *out = malloc(out_w * sizeof(uint16_t));
-    uint8_t *dict = malloc(TINFL_LZ_DICT_SIZE);
+size_t sped_index_size(const sped_index *idx)
+{
+    return (size_t)idx->size;
+}
+
+const sped_index *sped_index_load(const void *data, size_t size)
+{
+    const sped_index *idx = data;
+    if (size < IDX_HEAD || idx->magic != SPED_INDEX_MAGIC || idx->size != size ||
+        idx->snap != sped_stream_backend.snap || idx->win != SPED_WINDOW ||
+        idx->every == 0 || idx->ck_size < sizeof(sped_ckpt) + (uint64_t)idx->snap + idx->win + idx->stride ||
+        (size - IDX_HEAD) / idx->ck_size < idx->count)
+        return NULL;
+    return idx;
+}
 
-    /* Accumulator for downscaling: sum of R, G, B per output pixel */
-    uint16_t *acc = NULL;
-    if (scale > 1)
-        acc = calloc(out_w * 3, sizeof(uint16_t));
+void sped_index_free(sped_index *idx)
+{
+    free(idx);
+}
 
-    if (!cur || !prev || !out || !dict || (scale > 1 && !acc)) {
-        free(cur); free(prev); free(out); free(dict); free(acc);
+int sped_decode_rows(const void *png, size_t len, const sped_index *idx,
+                     int scale, int y0, int y1, sped_row_cb cb, void *user)
+{
+    sped_info_t info;
+    sped_rect_t rect;
+    if (scale < 1) return -1;
+    if (y0 < 0 || y1 <= y0 || sped_info(png, len, &info) != 0) return -1;
+    if (idx && (idx->png_len != len || idx->width != info.width || info.interlace ||
+                idx->height != info.height ||
+                idx->stride != png_row_bytes(info.width, png_bits(info.color_type, info.depth))))
         return -1;
+    rect.x = 0;
+    rect.w = info.width;
+    rect.y = (uint32_t)y0 * (uint32_t)scale;
+    rect.h = (uint32_t)(y1 - y0) * (uint32_t)scale;
+
+    /* The streaming backend: checkpoints are its state */
+    sped_out out = { .rect = &rect, .from = idx };
+    size_t n = ws_need(&info, scale, &out);
+    void *ws = n ? malloc(n) : NULL;
+    if (!ws) return -1;
+    int r = decode(png, len, scale, cb, user, &out, ws, n, 0, NULL);
+    free(ws);
+    return r;
+}
+
+/* ---- Reusable context ----
+ * Owns a workspace that only ever grows. Its head (decoder state,
+ * selected kernels, LUT, inflate state and window) survives between
+ * images, so a small image costs a backend reset rather than fresh
+ * allocations and setup. */
+
+/* Push parser states; idle until sped_push_begin and after a failure */
+enum { PS_IDLE, PS_SIG, PS_HEAD, PS_DATA, PS_CRC, PS_DONE };
+
+struct sped_ctx {
+    uint8_t *ws;
+    size_t ws_size;
+    int live;           /* ws head holds a started decoder */
+
+    /* Push decoding: chunks are parsed as bytes arrive */
+    sped_img *img;      /* NULL until IHDR is in */
+    sped_info_t info;
+    int scale;
+    sped_row_cb cb;
+    void *user;
+    int ps;             /* parser state */
+    int in_idat;        /* image data has started */
+    int paused;         /* img_feed stopped early; resume before parsing on */
+    int tail;           /* image data is over, inflate is finishing */
+    size_t budget;      /* per-call work budget for the image */
+    sped_band band;     /* band output for ctx and push decodes */
+    sped_bufs bufs;     /* rotating output buffers */
+    sped_rect_t rect;   /* ROI, if has_rect */
+    int has_rect;
+    sped_size size;     /* output size instead of scale, if w is set */
+    unsigned flags;     /* SPED_FLAGS */
+    sped_alpha alpha;   /* blending */
+    sped_spans spans;   /* span output for ctx and push decodes */
+    int kind;           /* alpha of the last image, SPED_OPAQUE.., -1 = unknown */
+
+    /* Pull decoding */
+    const uint8_t *src; /* the file, NULL when no pull decode is running */
+    size_t src_len, src_pos;
+    sped_row_cb pull_cb;
+    void *pull_user;
+    int want_row;       /* pause after each row */
+    const uint16_t *row;
+    int row_y, row_w;
+    uint8_t buf[13];    /* signature, chunk header or IHDR being gathered */
+    uint32_t have;      /* bytes of the current item seen so far */
+    uint32_t clen;      /* current chunk length */
+    uint8_t type[4];    /* current chunk type */
+};
+
+sped_ctx *sped_ctx_new(void)
+{
+    return calloc(1, sizeof(sped_ctx));
+}
+
+/* Stop the inflate backend living in the workspace head */
+static void ctx_retire(sped_ctx *ctx)
+{
+    if (ctx->live) {
+        sped_layout l;
+        sped_geom g = { 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+        ws_layout(&l, 1, 8, &g, 1, 1);
+        sped_stream_backend.end(ws_base(ctx->ws) + l.inf);
+        ctx->live = 0;
     }
+}
 
-    /* Init inflate */
-    tinfl_decompressor decomp;
-    tinfl_init(&decomp);
-    size_t dict_ofs = 0;
-
-    /* IDAT feed state */
-    int ci = 0;                       /* current IDAT index */
-    const uint8_t *in_ptr = idat[0].data;
-    size_t in_remain = idat[0].len;
-
-    /* Scanline assembly state */
-    int sl_pos = 0;        /* 0 = expecting filter byte, 1..stride = pixel data */
-    uint8_t filter = 0;
-    int row = 0;
-    int out_row = 0;
-
-    while (row < (int)h) {
-        /* Determine flags for tinfl */
-        int more = (ci < nidat - 1) || (in_remain > 0);
-        uint32_t flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
-        if (more) flags |= TINFL_FLAG_HAS_MORE_INPUT;
-
-        size_t in_bytes = in_remain;
-        size_t out_bytes = TINFL_LZ_DICT_SIZE - dict_ofs;
-
-        tinfl_status st = tinfl_decompress(&decomp, in_ptr, &in_bytes,
-                                           dict, dict + dict_ofs, &out_bytes,
-                                           flags);
-        in_ptr += in_bytes;
-        in_remain -= in_bytes;
-
-        /* Process decompressed output */
-        const uint8_t *dp = dict + dict_ofs;
-        size_t avail = out_bytes;
-        dict_ofs = (dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
-
-        while (avail > 0 && row < (int)h) {
-            if (sl_pos == 0) {
-                filter = *dp++;
-                avail--;
-                sl_pos = 1;
-            } else {
-                size_t need = (size_t)(stride - (sl_pos - 1));
-                size_t take = (avail < need) ? avail : need;
-                memcpy(cur + (sl_pos - 1), dp, take);
-                dp += take;
-                avail -= take;
-                sl_pos += (int)take;
-
-                if (sl_pos > stride) {
-                    /* Scanline complete — apply inverse filter */
-                    for (int i = 0; i < stride; i++) {
-                        uint8_t a = (i >= bpp) ? cur[i - bpp] : 0;
-                        uint8_t b = prev[i];
-                        uint8_t c_val = (i >= bpp) ? prev[i - bpp] : 0;
-                        switch (filter) {
-                            case 1: cur[i] += a; break;
-                            case 2: cur[i] += b; break;
-                            case 3: cur[i] += (uint8_t)((a + b) >> 1); break;
-                            case 4: cur[i] += paeth(a, b, c_val); break;
-                        }
-                    }
+/* Grow the workspace to n bytes */
+static int ctx_reserve(sped_ctx *ctx, size_t n)
+{
+    if (n <= ctx->ws_size) return 0;
+    /* the backend may point into the old block: start over */
+    bufs_drain(&ctx->bufs);
+    ctx_retire(ctx);
+    ctx->img = NULL;
+    free(ctx->ws);
+    ctx->ws = malloc(n);
+    ctx->ws_size = ctx->ws ? n : 0;
+    return ctx->ws ? 0 : -1;
+}
 
-                    if (scale == 1) {
-                        /* Convert to RGB565 and emit directly */
-                        for (uint32_t x = 0; x < w; x++) {
-                            uint8_t r, g, bl;
-                            get_pixel(cur, x, ctype, bpc, pal, &r, &g, &bl);
-                            out[x] = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (bl >> 3);
-                        }
-                        cb(row, (int)w, out, user);
-                    } else {
-                        /* Accumulate R/G/B for downscaling */
-                        uint32_t limit = out_w * (uint32_t)scale;
-                        for (uint32_t x = 0; x < limit && x < w; x++) {
-                            uint8_t r, g, bl;
-                            get_pixel(cur, x, ctype, bpc, pal, &r, &g, &bl);
-                            uint32_t ox = x / (uint32_t)scale;
-                            acc[ox * 3 + 0] += r;
-                            acc[ox * 3 + 1] += g;
-                            acc[ox * 3 + 2] += bl;
-                        }
-
-                        /* Emit averaged row every 'scale' input rows */
-                        if ((row % scale) == scale - 1) {
-                            int div = scale * scale;
-                            for (uint32_t ox = 0; ox < out_w; ox++) {
-                                uint8_t r  = (uint8_t)(acc[ox * 3 + 0] / div);
-                                uint8_t g  = (uint8_t)(acc[ox * 3 + 1] / div);
-                                uint8_t bl = (uint8_t)(acc[ox * 3 + 2] / div);
-                                out[ox] = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (bl >> 3);
-                            }
-                            cb(out_row, (int)out_w, out, user);
-                            out_row++;
-                            memset(acc, 0, out_w * 3 * sizeof(uint16_t));
-                        }
-                    }
+void sped_ctx_free(sped_ctx *ctx)
+{
+    if (!ctx) return;
+    ctx_retire(ctx);
+    free(ctx->ws);
+    free(ctx);
+}
 
-                    /* Swap cur/prev */
-                    uint8_t *tmp = prev; prev = cur; cur = tmp;
-                    memset(cur, 0, stride);
-                    row++;
-                    sl_pos = 0;
-                }
-            }
-        }
+int sped_ctx_decode(sped_ctx *ctx, const void *png, size_t len, int scale,
+                    sped_row_cb cb, void *user)
+{
+    sped_info_t info;
+    sped_end(ctx);   /* ends any push or pull decode */
+    ctx->kind = -1;
+    if (sped_info(png, len, &info) != 0) return -1;
+    sped_out out = { .flags = ctx->flags, .size = ctx->size.w ? &ctx->size : NULL,
+                     .band = ctx->spans.cb ? NULL : &ctx->band, .bufs = &ctx->bufs,
+                     .rect = ctx->has_rect ? &ctx->rect : NULL, .alpha = &ctx->alpha,
+                     .spans = ctx->spans.cb ? &ctx->spans : NULL, .kind = &ctx->kind };
+    size_t n = ws_need(&info, scale, &out);
+    if (n == 0 || ctx_reserve(ctx, n) < 0) return -1;
+    int r = decode(png, len, scale, cb, user, &out,
+                   ctx->ws, ctx->ws_size, 1, &ctx->live);
+    if (r < 0) ctx->kind = -1;
+    return r;
+}
+
+int sped_ctx_set_band(sped_ctx *ctx, int rows, size_t max_bytes,
+                      sped_band_cb cb, void *user)
+{
+    if (cb && (rows < 0 || (rows == 0 && max_bytes == 0))) return -1;
+    ctx->band.rows = rows;
+    ctx->band.bytes = max_bytes;
+    ctx->band.cb = cb;
+    ctx->band.user = user;
+    return 0;
+}
+
+void sped_ctx_set_spans(sped_ctx *ctx, sped_span_cb cb, void *user)
+{
+    ctx->spans.cb = cb;
+    ctx->spans.user = user;
+}
+
+int sped_ctx_set_size(sped_ctx *ctx, uint32_t w, uint32_t h, int fit)
+{
+    if ((w == 0) != (h == 0)) return -1;
+    ctx->size.w = w;
+    ctx->size.h = h;
+    ctx->size.fit = fit;
+    return 0;
+}
+
+int sped_ctx_set_flags(sped_ctx *ctx, unsigned flags)
+{
+    if (flags & ~(unsigned)SPED_FLAGS) return -1;
+    ctx->flags = flags;
+    return 0;
+}
+
+int sped_ctx_set_alpha(sped_ctx *ctx, int mode, uint16_t bg, sped_dst_cb dst,
+                       void *user)
+{
+    if (mode < SPED_ALPHA_IGNORE || mode > SPED_ALPHA_PLANE ||
+        (mode == SPED_ALPHA_DST && !dst))
+        return -1;
+    ctx->alpha.mode = mode;
+    ctx->alpha.bg = bg;
+    ctx->alpha.dst = mode == SPED_ALPHA_DST ? dst : NULL;
+    ctx->alpha.user = user;
+    return 0;
+}
+
+const uint8_t *sped_alpha_plane(const sped_ctx *ctx, const uint16_t *rgb565)
+{
+    /* the decoder of the current or last image heads the workspace */
+    const sped_img *im = ctx->ws ? (const sped_img *)ws_base(ctx->ws) : NULL;
+    if (!im || !im->d.plane || !im->d.alpha || !rgb565 || rgb565 < im->d.obase)
+        return NULL;
+    return im->d.plane + (rgb565 - im->d.obase);
+}
+
+int sped_ctx_alpha_kind(const sped_ctx *ctx)
+{
+    return ctx->kind;
+}
+
+void sped_ctx_set_rect(sped_ctx *ctx, const sped_rect_t *rect)
+{
+    ctx->has_rect = rect != NULL;
+    if (rect) ctx->rect = *rect;
+}
+
+int sped_ctx_set_buffers(sped_ctx *ctx, int count, void (*wait)(void *user),
+                         void *user)
+{
+    sped_bufs *b = &ctx->bufs;
+    if (count < 1 || count > SPED_MAX_BUFFERS) return -1;
+    bufs_drain(b);
+    b->count = count;
+    b->next = 0;
+    b->base = NULL;
+    b->wait = wait;
+    b->wait_user = user;
+    return 0;
+}
+
+void sped_release(sped_ctx *ctx, const uint16_t *rgb565)
+{
+    sped_bufs *b = &ctx->bufs;
+    if (b->count < 2 || !b->base || rgb565 < b->base) return;
+    size_t i = (size_t)(rgb565 - b->base) / b->slot;
+    if (i < (size_t)b->count) SPED_STORE(&b->busy[i], 0);
+}
+
+int sped_push_begin(sped_ctx *ctx, int scale, sped_row_cb cb, void *user)
+{
+    ctx->img = NULL;
+    ctx->paused = 0;
+    ctx->tail = 0;
+    ctx->budget = SIZE_MAX;
+    ctx->src = NULL;
+    ctx->scale = scale;
+    ctx->cb = cb;
+    ctx->user = user;
+    ctx->in_idat = 0;
+    ctx->have = 0;
+    ctx->kind = -1;
+    ctx->ps = scale >= 1 ? PS_SIG : PS_IDLE;
+    return ctx->ps == PS_IDLE ? -1 : 0;
+}
+
+int sped_ctx_info(const sped_ctx *ctx, sped_info_t *info)
+{
+    if (!ctx->img) return -1;
+    *info = ctx->info;
+    return 0;
+}
 
-        /* Advance to next IDAT chunk if needed */
-        if (in_remain == 0 && ci < nidat - 1) {
-            ci++;
-            in_ptr = idat[ci].data;
-            in_remain = idat[ci].len;
+/* A chunk header is complete in ctx->buf */
+static int push_head(sped_ctx *ctx)
+{
+    ctx->clen = r32(ctx->buf);
+    memcpy(ctx->type, ctx->buf + 4, 4);
+    if (ctx->clen > 0x7FFFFFFF) return -1;
+    if (!ctx->img)   /* IHDR must be the first chunk */
+        return ctx->clen == 13 && memcmp(ctx->type, "IHDR", 4) == 0 ? 0 : -1;
+    if (memcmp(ctx->type, "IDAT", 4) == 0) {
+        if (!ctx->in_idat) {
+            ctx->in_idat = 1;
+            return img_start(ctx->img, &ctx->live);
         }
+    } else if (ctx->in_idat) {
+        /* image data is over: whatever inflate holds must finish it */
+        size_t z = 0;
+        ctx->tail = 1;
+        int r = img_feed(ctx->img, ctx->buf, &z, 0);
+        return r == 0 ? -1 : r;
+    } else if (memcmp(ctx->type, "IEND", 4) == 0) {
+        return -1;
+    }
+    return 0;
+}
 
-        if (st == TINFL_STATUS_DONE) break;
-        if (st < 0) {
-            free(cur); free(prev); free(out); free(dict); free(acc);
-            return -1;
+/* IHDR is complete in ctx->buf: size the workspace, set up the image */
+static int push_ihdr(sped_ctx *ctx)
+{
+    sped_out out = { .flags = ctx->flags, .size = ctx->size.w ? &ctx->size : NULL,
+                     .band = ctx->src || ctx->spans.cb ? NULL : &ctx->band,   /* pull: rows */
+                     .bufs = &ctx->bufs, .rect = ctx->has_rect ? &ctx->rect : NULL,
+                     .alpha = &ctx->alpha, .kind = &ctx->kind,
+                     .spans = ctx->src || !ctx->spans.cb ? NULL : &ctx->spans };
+    int bits = hdr_check(ctx->buf);
+    if (bits < 0) return -1;
+    hdr_parse(ctx->buf, &ctx->info);
+    size_t n = ws_need(&ctx->info, ctx->scale, &out);
+    if (n == 0 || ctx_reserve(ctx, n) < 0) return -1;
+    ctx->img = img_init(ctx->ws, ctx->ws_size, &ctx->info, bits, ctx->scale,
+                        ctx->cb, ctx->user, &out, ctx->live);
+    if (!ctx->img) return -1;
+    ctx->img->budget = ctx->budget;
+    return 0;
+}
+
+/* Parse and decode up to *n bytes at p; *n becomes the bytes consumed.
+ * Returns 0 when all were consumed and more are wanted, 1 when the image
+ * is complete, IMG_PAUSED when decoding stopped early, -1 on error. */
+static int ctx_feed(sped_ctx *ctx, const uint8_t *p, size_t *n)
+{
+    size_t left = *n;
+    int r = 0;
+
+    if (ctx->ps == PS_DONE) return 1;
+    if (ctx->ps == PS_IDLE) return -1;
+    if (ctx->paused) {
+        size_t z = 0;
+        ctx->paused = 0;
+        r = img_feed(ctx->img, p, &z, !ctx->tail);
+        if (r == 0 && ctx->tail) r = -1;
+    }
+
+    while (left > 0 && r == 0) {
+        size_t k;
+        switch (ctx->ps) {
+        case PS_SIG:
+        case PS_HEAD:
+            k = 8 - ctx->have;
+            if (k > left) k = left;
+            memcpy(ctx->buf + ctx->have, p, k);
+            ctx->have += (uint32_t)k;
+            if (ctx->have == 8) {
+                ctx->have = 0;
+                if (ctx->ps == PS_SIG) {
+                    r = memcmp(ctx->buf, png_sig, 8) == 0 ? 0 : -1;
+                    ctx->ps = PS_HEAD;
+                } else {
+                    r = push_head(ctx);
+                    ctx->ps = ctx->clen ? PS_DATA : PS_CRC;
+                }
+            }
+            break;
+        case PS_DATA:
+            k = ctx->clen - ctx->have;
+            if (k > left) k = left;
+            if (!ctx->img) {
+                memcpy(ctx->buf + ctx->have, p, k);
+                if (ctx->have + k == 13) r = push_ihdr(ctx);
+            } else if (ctx->in_idat) {
+                r = img_feed(ctx->img, p, &k, 1);
+            } else {
+                img_meta(ctx->img, ctx->type, ctx->have, p, k);
+            }
+            ctx->have += (uint32_t)k;
+            if (ctx->have == ctx->clen) {
+                ctx->have = 0;
+                ctx->ps = PS_CRC;
+            }
+            break;
+        default:   /* PS_CRC */
+            k = 4 - ctx->have;
+            if (k > left) k = left;
+            ctx->have += (uint32_t)k;
+            if (ctx->have == 4) {
+                ctx->have = 0;
+                ctx->ps = PS_HEAD;
+            }
+            break;
         }
+        p += k;
+        left -= k;
+    }
+    *n -= left;
+
+    if (r == IMG_PAUSED) {
+        ctx->paused = 1;
+    } else if (r < 0) {
+        if (ctx->img) img_flush(ctx->img, 0);   /* rows so far, as row by row */
+        ctx->ps = PS_IDLE;
+    } else if (r > 0) {
+        img_end(ctx->img, &ctx->live);
+        ctx->ps = PS_DONE;
     }
+    return r;
+}
+
+int sped_feed(sped_ctx *ctx, const void *data, size_t n)
+{
+    return ctx_feed(ctx, data, &n);
+}
+
+/* ---- Pull decoding ----
+ * The push parser run over an in-memory file, a bounded amount at a
+ * time. Rows are caught by pull_row on their way to the user's
+ * callback; sped_next_row pauses the decoder after each one. */
+
+static void pull_row(int y, int w, const uint16_t *rgb565, void *user)
+{
+    sped_ctx *ctx = user;
+    ctx->row_y = y;
+    ctx->row_w = w;
+    ctx->row = rgb565;
+    if (ctx->pull_cb) ctx->pull_cb(y, w, rgb565, ctx->pull_user);
+    if (ctx->want_row) ctx->img->pause = 1;
+}
 
-    free(cur); free(prev); free(out); free(dict); free(acc);
+int sped_begin(sped_ctx *ctx, const void *png, size_t len, int scale,
+               sped_row_cb cb, void *user)
+{
+    if (sped_push_begin(ctx, scale, pull_row, ctx) < 0) return -1;
+    ctx->src = png;
+    ctx->src_len = len;
+    ctx->src_pos = 0;
+    ctx->pull_cb = cb;
+    ctx->pull_user = user;
+    ctx->row = NULL;
+    ctx->want_row = 0;
     return 0;
 }
+
+/* Run the pull decoder over the rest of the file */
+static int pull_run(sped_ctx *ctx)
+{
+    size_t n = ctx->src_len - ctx->src_pos;
+    int r = ctx_feed(ctx, ctx->src + ctx->src_pos, &n);
+    ctx->src_pos += n;
+    if (r == 0) {
+        /* whole file consumed and the image still incomplete */
+        ctx->ps = PS_IDLE;
+        r = -1;
+    }
+    return r;
+}
+
+int sped_step(sped_ctx *ctx, size_t max_bytes)
+{
+    if (!ctx->src) return -1;
+    ctx->budget = max_bytes ? max_bytes : 1;
+    if (ctx->img) ctx->img->budget = ctx->budget;
+    int r = pull_run(ctx);
+    ctx->budget = SIZE_MAX;
+    if (ctx->img) ctx->img->budget = SIZE_MAX;
+    return r == IMG_PAUSED ? 1 : r > 0 ? 0 : -1;
+}
+
+int sped_next_row(sped_ctx *ctx, int *y, int *w, const uint16_t **rgb565)
+{
+    if (!ctx->src) return -1;
+    ctx->row = NULL;
+    ctx->want_row = 1;
+    int r = pull_run(ctx);
+    ctx->want_row = 0;
+    if (ctx->row) {
+        *y = ctx->row_y;
+        *w = ctx->row_w;
+        *rgb565 = ctx->row;
+        return 1;
+    }
+    return r > 0 ? 0 : -1;
+}
+
+void sped_end(sped_ctx *ctx)
+{
+    ctx->ps = PS_IDLE;
+    ctx->paused = 0;
+    ctx->src = NULL;
+    ctx->img = NULL;
+}
@@ -3,10 +3,13 @@
  *
  * Minimal streaming PNG decoder for embedded systems.
  * Outputs RGB565 row-by-row via callback. Uses tinfl (from miniz)
- * for DEFLATE decompression. Supports 1/2 and 1/4 downscaling.
+ * for DEFLATE decompression. Downscales by any factor or to any size.
  *
- * Supports: 8-bit grayscale, RGB, RGBA, grayscale+alpha, indexed (palette).
- * Does not support: interlacing, 16-bit channels, CRC verification.
+ * Supports: grayscale, RGB, RGBA, grayscale+alpha, indexed (palette) at
+ * every PNG bit depth (1/2/4/8-bit gray and palette, 16-bit channels
+ * truncated to 8), Adam7 interlacing, alpha blending from alpha channels
+ * and tRNS.
+ * Does not support: CRC verification.
  *
  * MIT License — see LICENSE file.
  */
@@ -19,18 +22,269 @@
 typedef struct {
     uint32_t width;
     uint32_t height;
+    uint8_t depth;          /* bits per channel */
+    uint8_t color_type;     /* PNG color type: 0, 2, 3, 4 or 6 */
+    uint8_t interlace;      /* 0 = none, 1 = Adam7 */
 } sped_info_t;
 
+/* Rectangle in image pixels */
+typedef struct {
+    uint32_t x, y, w, h;
+} sped_rect_t;
+
 /* Row callback: y = row (0=top), w = width, rgb565 = pixel data.
  * Called once per row during decoding. */
 typedef void (*sped_row_cb)(int y, int w, const uint16_t *rgb565, void *user);
 
-/* Get image dimensions without decoding. Returns 0 on success. */
+/* Get image header without decoding. Returns 0 on success. */
 int sped_info(const void *png, size_t len, sped_info_t *info);
 
 /* Decode PNG to RGB565. Calls cb for each row. Returns 0 on success.
- * scale: 1 = full, 2 = half, 4 = quarter resolution. */
+ * scale: 1 = full, 2 = half, 4 = quarter resolution; any other factor
+ * n >= 2 gives width/n x height/n through the (slower) area filter.
+ * Rows and columns that don't make up a whole n x n block are dropped.
+ * Interlaced (Adam7) images are buffered whole at the output size, and
+ * when downscaled each output pixel is the source pixel at its top left:
+ * at scale 8 only the first pass is inflated, at 4 the first three. */
 int sped_decode(const void *png, size_t len, int scale,
                 sped_row_cb cb, void *user);
 
+/* Decode PNG downscaled to w x h, each no larger than the image's and
+ * scaled independently. With fit set, w x h is a box instead: the image
+ * is scaled to the largest size that fits it with its aspect ratio kept,
+ * and is never enlarged. Each output pixel is the area-weighted mean of
+ * the source pixels it covers; sizes that are an exact 1/2 or 1/4 use
+ * the box kernels. Returns 0 on success, -1 if the size is out of range. */
+int sped_decode_size(const void *png, size_t len, uint32_t w, uint32_t h,
+                     int fit, sped_row_cb cb, void *user);
+
+/* The output size sped_decode_size would give this image in *out_w and
+ * *out_h. Returns 0, or -1 if the size is out of range. */
+int sped_scaled_size(const sped_info_t *info, uint32_t w, uint32_t h, int fit,
+                     uint32_t *out_w, uint32_t *out_h);
+
+/* Decode only the part of the image within rect, given in full-size
+ * pixels and widened to the output pixels it touches. cb gets the rows of
+ * that part: y is still the row in the (scaled) image, w the part's
+ * width, rgb565 its first pixel. Rows above it are unfiltered but not
+ * converted, columns to its right are not processed at all, and decoding
+ * stops after its last row. Returns -1 if rect misses the image. */
+int sped_decode_rect(const void *png, size_t len, int scale,
+                     const sped_rect_t *rect, sped_row_cb cb, void *user);
+
+/* Decode PNG straight into an RGB565 surface of dst_w x dst_h pixels
+ * whose rows are pitch bytes apart, with the image's top left pixel at
+ * (x0, y0). Either may be negative; whatever falls outside the surface
+ * is clipped. Returns 0 on success. */
+int sped_decode_to_buffer(const void *png, size_t len, int scale,
+                          uint16_t *dst, size_t pitch, int dst_w, int dst_h,
+                          int x0, int y0);
+
+/* As sped_decode_to_buffer, but images with alpha (an alpha channel, or
+ * tRNS: palette alpha or a gray or RGB color key) are blended onto what
+ * the surface already holds, instead of replacing it. Transparent pixels
+ * leave it untouched. Downscales use the area filter. */
+int sped_blend_to_buffer(const void *png, size_t len, int scale,
+                         uint16_t *dst, size_t pitch, int dst_w, int dst_h,
+                         int x0, int y0);
+
+/* Row index for random access to tall images. sped_index_build decodes
+ * the image once at full size (rows go to cb, which may be NULL) and
+ * records a checkpoint every `every` rows, rounded up to a multiple of 4.
+ * Each checkpoint holds the inflate state, the 32 KB window and one
+ * scanline. sped_decode_rows then decodes output rows [y0, y1) at any
+ * scale, starting from the nearest checkpoint above y0 rather than from
+ * the top. It only reads the index, so several threads can decode
+ * different stripes of one image at once.
+ *
+ * The index is a single block of sped_index_size() bytes that can be
+ * saved as is. sped_index_load checks such a block (it must stay valid
+ * and be aligned like malloc memory) and returns it as an index, or NULL
+ * if it doesn't fit this build. An index only suits the file it was built
+ * from. Requires the tinfl or built-in inflater: with zlib, and for
+ * interlaced images, sped_index_build returns NULL. idx may be NULL to
+ * decode from the top. */
+typedef struct sped_index sped_index;
+
+sped_index *sped_index_build(const void *png, size_t len, int every,
+                             sped_row_cb cb, void *user);
+size_t sped_index_size(const sped_index *idx);
+const sped_index *sped_index_load(const void *data, size_t size);
+void sped_index_free(sped_index *idx);
+int sped_decode_rows(const void *png, size_t len, const sped_index *idx,
+                     int scale, int y0, int y1, sped_row_cb cb, void *user);
+
+/* Decode flags */
+#define SPED_NEAREST 1u   /* downscale by picking the source pixel nearest each
+                           * output pixel's centre: rows and pixels that aren't
+                           * picked are unfiltered but never converted. For
+                           * quick previews and thumbnails. */
+#define SPED_PROGRESSIVE 2u /* interlaced images: emit the whole image after
+                           * each Adam7 pass, pixels not yet decoded filled
+                           * from the nearest decoded one above and to the
+                           * left, so a coarse 1/8 image arrives first and
+                           * every row is sent again as it sharpens. */
+
+/* Workspace bytes sped_decode_ws needs for this image, scale and flags,
+ * or 0 if the image can't be decoded. */
+size_t sped_workspace_size(const sped_info_t *info, int scale, unsigned flags);
+
+/* As sped_decode, but all decoder state lives in the caller's buffer
+ * ws[0..ws_size): no heap allocation and little stack. Any alignment is
+ * fine. flags: 0 or SPED_NEAREST / SPED_PROGRESSIVE. Returns -1 if ws
+ * is smaller than sped_workspace_size(). */
+int sped_decode_ws(const void *png, size_t len, int scale, unsigned flags,
+                   sped_row_cb cb, void *user, void *ws, size_t ws_size);
+
+/* Reusable decoder context. It keeps its buffers, kernel choices and
+ * inflate state between images, so decoding many small images through
+ * one context skips most of the per-image setup. Not thread-safe: use
+ * one context per thread. */
+typedef struct sped_ctx sped_ctx;
+
+sped_ctx *sped_ctx_new(void);
+void sped_ctx_free(sped_ctx *ctx);
+
+/* As sped_decode, using ctx's buffers. Returns 0 on success. */
+int sped_ctx_decode(sped_ctx *ctx, const void *png, size_t len, int scale,
+                    sped_row_cb cb, void *user);
+
+/* ROI for ctx decodes (all modes) from the next image on, as for
+ * sped_decode_rect; NULL = whole image */
+void sped_ctx_set_rect(sped_ctx *ctx, const sped_rect_t *rect);
+
+/* Flags (SPED_NEAREST, SPED_PROGRESSIVE) for ctx decodes (all modes)
+ * from the next image on. Returns -1 for unknown flags. */
+int sped_ctx_set_flags(sped_ctx *ctx, unsigned flags);
+
+/* Output size for ctx decodes (all modes) from the next image on, as for
+ * sped_decode_size; the scale argument is then ignored. w = h = 0 goes
+ * back to scale. Returns -1 if only one of them is 0. */
+int sped_ctx_set_size(sped_ctx *ctx, uint32_t w, uint32_t h, int fit);
+
+/* Alpha modes */
+#define SPED_ALPHA_IGNORE 0 /* alpha and tRNS are dropped: all pixels opaque */
+#define SPED_ALPHA_BG     1 /* blended onto a constant background color */
+#define SPED_ALPHA_DST    2 /* blended onto the pixels already there */
+#define SPED_ALPHA_PLANE  3 /* not blended: colors as they are, and alpha in
+                             * a plane beside them (sped_alpha_plane) */
+
+/* Destination rows for SPED_ALPHA_DST: fill rgb565[0..w) with the pixels
+ * output row y (as the row callback will see it) goes onto, e.g. read
+ * back from the framebuffer. */
+typedef void (*sped_dst_cb)(int y, int w, uint16_t *rgb565, void *user);
+
+/* Alpha for ctx decodes (all modes) from the next image on. Images with
+ * an alpha channel, palette alpha or a tRNS color key are blended as they
+ * are converted, in fixed point, onto bg (RGB565) or onto the rows dst
+ * fills in; other images decode as without. Downscales then use the area
+ * filter, which weights colors by alpha. Each refinement of a progressive
+ * image is blended anew. Default SPED_ALPHA_IGNORE. Returns -1 for an
+ * unknown mode, or SPED_ALPHA_DST without dst. */
+int sped_ctx_set_alpha(sped_ctx *ctx, int mode, uint16_t bg, sped_dst_cb dst,
+                       void *user);
+
+/* With SPED_ALPHA_PLANE or spans, the alpha of pixels ctx delivered:
+ * rgb565 is a row, band or span as the callback or sped_next_row got it,
+ * and the plane has a byte per pixel (255 = opaque) in the same order. It
+ * is valid as long as the pixels are. Downscaled pixels carry their mean
+ * alpha and, with SPED_ALPHA_PLANE, the mean color of what covers them.
+ * NULL if the image has no alpha (all opaque), or when neither
+ * SPED_ALPHA_PLANE nor spans are on. */
+const uint8_t *sped_alpha_plane(const sped_ctx *ctx, const uint16_t *rgb565);
+
+/* Alpha of the last image decoded on ctx, once it is complete: opaque,
+ * binary (0 or 255 only, a mask) or partial. Taken from the source pixels
+ * the decode converted. -1 if alpha was ignored or no decode finished. */
+#define SPED_OPAQUE        0
+#define SPED_ALPHA_BINARY  1
+#define SPED_ALPHA_PARTIAL 2
+int sped_ctx_alpha_kind(const sped_ctx *ctx);
+
+/* Band callback: h rows starting at row y, each w pixels, one after
+ * another in rgb565 (w * h pixels). */
+typedef void (*sped_band_cb)(int y, int w, int h, const uint16_t *rgb565,
+                             void *user);
+
+/* Band output for sped_ctx_decode and push decoding on ctx, from the
+ * next image on. Rows are gathered into bands of up to rows rows, or of
+ * as many as fit in max_bytes bytes (0 = no limit; set at least one;
+ * a band always holds at least one row), and cb receives each band in
+ * place of the row callback, which may then be NULL. The last band is
+ * flushed at the end of the image, or when decoding fails. The band
+ * buffer is reused: consume it before returning. Pull decoding always
+ * delivers rows. cb = NULL turns bands off. Returns 0, or -1 if the
+ * limits are invalid. */
+int sped_ctx_set_band(sped_ctx *ctx, int rows, size_t max_bytes,
+                      sped_band_cb cb, void *user);
+
+/* A run of pixels in output row y: columns x .. x+w-1, counted from the
+ * row's first pixel as in the row callback, at rgb565 */
+typedef struct {
+    int x, w;
+    const uint16_t *rgb565;
+} sped_span_t;
+
+/* Span callback: the n spans of row y, left to right */
+typedef void (*sped_span_cb)(int y, const sped_span_t *spans, int n,
+                             void *user);
+
+/* Span output for sped_ctx_decode and push decoding on ctx, from the
+ * next image on, for blitting sprites a window at a time. Each row goes
+ * to cb, in place of the row callback (which may then be NULL) and of
+ * bands, as its spans of pixels that are not fully transparent; rows
+ * that are all transparent are skipped. Alpha is taken as for blending.
+ * Pixels are blended as set with sped_ctx_set_alpha, and left as they
+ * are with SPED_ALPHA_IGNORE or SPED_ALPHA_PLANE. An image without alpha
+ * has one span per row. Pull decoding always delivers rows. cb = NULL
+ * turns spans off. */
+void sped_ctx_set_spans(sped_ctx *ctx, sped_span_cb cb, void *user);
+
+/* Rotating output buffers for ctx decodes (default 1). With count >= 2
+ * (at most 4 unless built with a larger SPED_MAX_BUFFERS), each row or
+ * band goes into the next of count buffers, and the buffer handed to the
+ * callback, or returned by sped_next_row, stays the consumer's until it
+ * calls sped_release, for instance from a DMA-complete interrupt or
+ * another thread. Decoding carries on into the other buffers meanwhile;
+ * when the next one is still out, the decoder waits, calling wait(user)
+ * in a loop if set (to poll a transfer or yield), else spinning. Waits
+ * for all buffers to come back first. Returns 0, or -1 if count is out
+ * of range. Release every buffer before sped_ctx_free. */
+int sped_ctx_set_buffers(sped_ctx *ctx, int count, void (*wait)(void *user),
+                         void *user);
+void sped_release(sped_ctx *ctx, const uint16_t *rgb565);
+
+/* Push decoding, for data that arrives in pieces (flash, SD, sockets).
+ * Start an image with sped_push_begin, then hand over the file in
+ * pieces of any size with sped_feed; cb fires as soon as each row is
+ * complete. Only the context's workspace is kept, never the file.
+ * sped_feed returns 0 when it wants more data, 1 once the image is
+ * complete (further data is ignored) and -1 on error. */
+int sped_push_begin(sped_ctx *ctx, int scale, sped_row_cb cb, void *user);
+int sped_feed(sped_ctx *ctx, const void *data, size_t n);
+
+/* Header of the image being decoded; -1 until its IHDR has been read */
+int sped_ctx_info(const sped_ctx *ctx, sped_info_t *info);
+
+/* Pull decoding of a PNG in memory, resumable between calls so it can be
+ * interleaved with display DMA or a UI frame loop. png must stay valid
+ * until the decode ends. cb may be NULL; if set, it sees every row.
+ *
+ * sped_next_row decodes until the next output row is ready. It returns
+ * 1 with *y, *w and *rgb565 set (the row stays valid until the next
+ * call, or with rotating buffers until released), 0 once the image is
+ * finished, and -1 on error.
+ *
+ * sped_step does a bounded amount of work: it assembles at most
+ * max_bytes of decompressed scanline data (at least 1), delivering rows
+ * to cb, and inflates at most one window ahead of that. It returns 1 if
+ * there is more to do, 0 once the image is finished, and -1 on error.
+ *
+ * sped_end stops the decode at any point; the context stays usable. */
+int sped_begin(sped_ctx *ctx, const void *png, size_t len, int scale,
+               sped_row_cb cb, void *user);
+int sped_next_row(sped_ctx *ctx, int *y, int *w, const uint16_t **rgb565);
+int sped_step(sped_ctx *ctx, size_t max_bytes);
+void sped_end(sped_ctx *ctx);
+
 #endif /* SPED_H */
@@ -0,0 +1,157 @@
+/*
+ * window_test.c — rows across the inflate window, against real tinfl
+ *
+ * Builds PNGs in memory with miniz whose scanlines straddle the 32 KB
+ * inflate window, or are wider than it, and decodes them in one call,
+ * pushed in small pieces, and with sped_step at several budgets. Every
+ * row must come out, in order, and match the source pixels.
+ *
+ *   cc -O2 -I. -I<miniz> tests/window_test.c sped.c miniz.c -o window_test
+ */
+
+#include "sped.h"
+#include "miniz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const uint16_t *want;   /* expected RGB565, width x height */
+    uint32_t w, h;
+    int next;               /* next row expected */
+    int bad;
+} check;
+
+static int fails;
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);  p[3] = (uint8_t)v;
+}
+
+static uint8_t *chunk(uint8_t *p, const char *type, const uint8_t *data, size_t n)
+{
+    put32(p, (uint32_t)n);
+    memcpy(p + 4, type, 4);
+    if (n) memcpy(p + 8, data, n);
+    put32(p + 8 + n, (uint32_t)mz_crc32(mz_crc32(0, NULL, 0), p + 4, n + 4));
+    return p + 12 + n;
+}
+
+/* 8-bit gray (ctype 0) or RGB (ctype 2) image of w x h, its IDAT split
+ * into pieces of `split` bytes. Rows cycle through filters None, Sub
+ * and Up. Returns the PNG, sets *len and *want. */
+static uint8_t *make_png(uint32_t w, uint32_t h, int ctype, size_t split,
+                         size_t *len, uint16_t **want)
+{
+    size_t bpp = ctype == 2 ? 3 : 1, stride = w * bpp;
+    uint8_t *pix = malloc(stride * h), *raw = malloc((stride + 1) * h);
+    *want = malloc((size_t)w * h * sizeof(uint16_t));
+    uint32_t seed = w * 2654435761u ^ h;
+    for (size_t i = 0; i < stride * h; i++) {
+        seed = seed * 1103515245u + 12345u;
+        pix[i] = (uint8_t)(seed >> 16);
+    }
+    for (uint32_t y = 0; y < h; y++) {
+        const uint8_t *s = pix + y * stride, *up = y ? s - stride : NULL;
+        uint8_t *r = raw + y * (stride + 1);
+        r[0] = (uint8_t)(y % 3);
+        for (size_t i = 0; i < stride; i++) {
+            uint8_t pred = r[0] == 1 ? (i >= bpp ? s[i - bpp] : 0)
+                         : r[0] == 2 ? (up ? up[i] : 0) : 0;
+            r[1 + i] = (uint8_t)(s[i] - pred);
+        }
+        for (uint32_t x = 0; x < w; x++) {
+            const uint8_t *p = s + x * bpp;
+            uint8_t cr = p[0], cg = p[bpp > 1], cb = p[bpp > 1 ? 2 : 0];
+            (*want)[(size_t)y * w + x] = (uint16_t)(((cr & 0xF8) << 8) | ((cg & 0xFC) << 3) | (cb >> 3));
+        }
+    }
+
+    mz_ulong zn = mz_compressBound((mz_ulong)((stride + 1) * h));
+    uint8_t *z = malloc(zn);
+    if (mz_compress2(z, &zn, raw, (mz_ulong)((stride + 1) * h), 6) != MZ_OK) {
+        fprintf(stderr, "mz_compress2 failed\n");
+        exit(1);
+    }
+    free(pix);
+    free(raw);
+
+    uint8_t *png = malloc(zn + (zn / split + 1) * 12 + 64), *p = png, ihdr[13];
+    memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+    p += 8;
+    put32(ihdr, w);
+    put32(ihdr + 4, h);
+    ihdr[8] = 8;
+    ihdr[9] = (uint8_t)ctype;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    p = chunk(p, "IHDR", ihdr, 13);
+    for (size_t o = 0; o < zn; o += split)
+        p = chunk(p, "IDAT", z + o, zn - o < split ? zn - o : split);
+    p = chunk(p, "IEND", NULL, 0);
+    free(z);
+    *len = (size_t)(p - png);
+    return png;
+}
+
+static void row_check(int y, int w, const uint16_t *rgb565, void *user)
+{
+    check *c = user;
+    if (c->bad) return;
+    if (y != c->next || (uint32_t)w != c->w ||
+        memcmp(rgb565, c->want + (size_t)y * c->w, (size_t)w * sizeof(uint16_t)) != 0)
+        c->bad = 1;
+    c->next++;
+}
+
+static void expect(const char *what, uint32_t w, uint32_t h, int r, const check *c)
+{
+    if (r == 0 && !c->bad && (uint32_t)c->next == h) return;
+    printf("FAIL %ux%u %s: r %d, rows %d of %u%s\n", w, h, what, r, c->next, h,
+           c->bad ? ", wrong pixels" : "");
+    fails++;
+}
+
+static void run(uint32_t w, uint32_t h, int ctype, size_t split)
+{
+    size_t len;
+    uint16_t *want;
+    uint8_t *png = make_png(w, h, ctype, split, &len, &want);
+    check c = { want, w, h, 0, 0 };
+
+    expect("decode", w, h, sped_decode(png, len, 1, row_check, &c), &c);
+
+    sped_ctx *ctx = sped_ctx_new();
+    static const size_t budgets[] = { 1, 777, 4096, 40000 };
+    for (size_t i = 0; i < sizeof budgets / sizeof budgets[0]; i++) {
+        char what[32];
+        int r;
+        c.next = c.bad = 0;
+        if (sped_begin(ctx, png, len, 1, row_check, &c) != 0) r = -1;
+        else while ((r = sped_step(ctx, budgets[i])) == 1) {}
+        snprintf(what, sizeof what, "step %zu", budgets[i]);
+        expect(what, w, h, r, &c);
+    }
+
+    c.next = c.bad = 0;
+    int r = sped_push_begin(ctx, 1, row_check, &c);
+    for (size_t o = 0; o < len && r == 0; o += 7)
+        r = sped_feed(ctx, png + o, len - o < 7 ? len - o : 7);
+    expect("push", w, h, r == 1 ? 0 : -1, &c);
+
+    sped_ctx_free(ctx);
+    free(png);
+    free(want);
+}
+
+int main(void)
+{
+    run(555, 70, 0, 997);       /* gray rows straddling the window */
+    run(1000, 50, 2, 997);      /* RGB rows straddling the window */
+    run(2049, 20, 2, 65536);    /* 6 KB rows, one IDAT */
+    run(40000, 3, 0, 4096);     /* rows wider than the window */
+    run(37, 29, 2, 64);         /* small image, for the step budgets */
+    printf(fails ? "%d failed\n" : "ok\n", fails);
+    return fails != 0;
+}